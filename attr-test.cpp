@@ -0,0 +1,42 @@
+#include "ev3dev.h"
+#include <cstring>
+#include <string>
+#include <system_error>
+#undef NDEBUG // the checks run in release builds (MODE=Release) too
+#include <cassert>
+
+// errors of attribute handles, which name the attribute they failed on
+
+using namespace ev3dev;
+
+#if defined( __cpp_exceptions ) || defined( __EXCEPTIONS )
+template< typename F >
+std::string error_of( F f ) {
+    try {
+        f();
+    } catch ( const std::system_error &e ) {
+        return e.what();
+    }
+    return std::string();
+}
+#endif
+
+int main() {
+    const attribute< int > missing( "/nonexistent/ev3dev-attr-test/position" );
+    int v = 0;
+    const std::error_code ec = missing.try_get( v );
+    assert( ec );
+
+#if defined( __cpp_exceptions ) || defined( __EXCEPTIONS )
+    const std::string read = error_of( [&] { missing.get(); } );
+    assert( read.find( "/nonexistent/ev3dev-attr-test/position" ) != std::string::npos );
+
+    const std::string write = error_of( [&] { missing.set( 1 ); } );
+    assert( write.find( "/nonexistent/ev3dev-attr-test/position" ) != std::string::npos );
+
+    const std::string unconnected = error_of( [] { attribute< std::string >().get(); } );
+    assert( unconnected.find( "unconnected attribute" ) != std::string::npos );
+#endif
+
+    return 0;
+}
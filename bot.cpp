@@ -109,11 +109,11 @@ int isBlack (int x)
 
 struct CrossroadAnalyzer {
 
-    CrossroadAnalyzer() : data( 8 ) { }
+    CrossroadAnalyzer() { }
 
     void run() {
         while ( !killFlag ) {
-            data.waitAndReadOnce( [&]( Buffer< SensorData > &sensorData ) {
+            data.waitAndReadOnce( [&]( Buffer< SensorData, 8 > &sensorData ) {
                     process( sensorData );
                 } );
         }
@@ -121,7 +121,7 @@ struct CrossroadAnalyzer {
 
     // this function will be called every time data are avalibale, it should
     // produce result into result variable, it shoud not access data variable
-    void process( Buffer< SensorData > &sensorData ) {
+    void process( Buffer< SensorData, 8 > &sensorData ) {
 
         /*TODO: this could mean that we are on crossroad/angle
         we should look at history and analyze it:*/
@@ -206,7 +206,7 @@ struct CrossroadAnalyzer {
         result.assign( 42 /* pass result back to main thread */ );
     }
 
-    job::GuardedVar< Buffer< SensorData > > data;
+    job::GuardedVar< Buffer< SensorData, 8 > > data;
     job::GuardedVar< int > result; // or watever data type is needed here
 };
 
@@ -214,7 +214,7 @@ struct CrossroadAnalyzer {
 class SensorAnalyzer {
 public:
     SensorAnalyzer( CrossroadAnalyzer &ca ) :
-        _dataBuf( 8 ), _linePid( -1, 10, 15, 100, 0 ), crossroadAnalyzer( ca )
+        _linePid( -1, 10, 15, 100, 0 ), crossroadAnalyzer( ca )
     { }
 
     void save( SensorData &&data ) {
@@ -329,7 +329,7 @@ protected:
     SensorData &data() { return _data; }
 
 private:
-    Buffer< SensorData > _dataBuf;
+    Buffer< SensorData, 8 > _dataBuf;
     SensorData _data;
     PID _linePid;
     CrossroadAnalyzer &crossroadAnalyzer;
@@ -361,7 +361,9 @@ public:
             written = true;
         }
 
-        const int intensity = _eye.value(0) + _eye.value(1) + _eye.value(2);
+        int rgb[3] = {};
+        _eye.values(rgb, 3); // one read of bin_data for all channels
+        const int intensity = rgb[0] + rgb[1] + rgb[2];
         const int is_black = (intensity < 382) ? 1 : 0;
 
         _data.add( _motor.position(), is_black );
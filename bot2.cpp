@@ -9,9 +9,12 @@
 #include <thread>
 #include <chrono>
 #include <cassert>
+#include <cmath>
 #include "job.h"
 #include "buffer.h"
 #include "navigator.h"
+#include "sampler.h"
+#include <linux/input.h>
 
 
 using namespace ev3dev;
@@ -28,6 +31,7 @@ struct DataPoint {
 };
 
 using SwipeData = std::vector<DataPoint>;
+using SwipeHistory = Buffer< SwipeData, HISTORY_SIZE >;
 
 
 // http://www.mstarlabs.com/apeng/techniques/pidsoftw.html
@@ -70,31 +74,29 @@ struct PID {
 
 struct CrossroadAnalyzer {
 
-    CrossroadAnalyzer() :
-        data( std::pair< Buffer< SwipeData >, int >( { HISTORY_SIZE }, 0 ) )
-    {
+    CrossroadAnalyzer() {
         _navigator.initialize();
     }
 
     void run() {
         while ( !killFlag ) {
-            data.waitAndReadOnce( [&]( std::pair< Buffer< SwipeData >, int > &sensorData ) { process( sensorData ); } );
+            data.waitAndRead( [&]( std::pair< SwipeHistory, int > &sensorData ) { process( sensorData ); } );
         }
     }
 
-    job::GuardedVar< std::pair< Buffer< SwipeData >, int > > data;
-    job::GuardedVar< int > result; // or watever data type is needed here
+    job::Mailbox< std::pair< SwipeHistory, int > > data;
+    job::Mailbox< int > result; // or watever data type is needed here
 
 protected:
     // this function will be called every time data are avalibale, it should
     // produce result into result variable, it shoud not access data variable
-    void process( std::pair< Buffer< SwipeData >, int > &sensorData ) {
+    void process( std::pair< SwipeHistory, int > &sensorData ) {
         process( sensorData.first, sensorData.second );
 
         sensorData.first.clear();
     }
 
-    void process( Buffer< SwipeData > &sensorData, int distance ) {
+    void process( SwipeHistory &sensorData, int distance ) {
         std::cout << "crossroad analyser" << std::endl;
 
         int low_last = -1000;
@@ -152,7 +154,8 @@ protected:
             direction = 0;
         }
 
-        result.assign( direction );
+        result.back() = direction;
+        result.publish();
     }
 private:
     Navigator _navigator;
@@ -171,11 +174,13 @@ public:
     }
 
     void stop() {
+        abandon();
         _motor_L.stop();
         _motor_R.stop();
     }
 
     void forward() {
+        abandon();
         _motor_L.set_run_mode( motor::run_mode_forever );
         _motor_R.set_run_mode( motor::run_mode_forever );
 
@@ -188,9 +193,22 @@ public:
         _motor_R.set_pulses_per_second_sp( speed + i );
     }
 
+    // setpoints are written on io.submit()
+    void adjust( int i, io_batch &io ) {
+        _motor_L.queue_pulses_per_second_sp( io, speed - i );
+        _motor_R.queue_pulses_per_second_sp( io, speed + i );
+    }
+
+    // Starts a turn at a crossroad. The turn does not block, step() has to be
+    // called on every control tick until done(). It goes forward to the
+    // centre of the crossroad, rotates (unless direction is 0) and then drives
+    // forward again until the line is found in a sweep. Rotation is cut short
+    // if the line shows up near the centre once most of it is done.
     void turn(const int direction) {
         std::cout << "turn: " << direction << std::endl;
 
+        _direction = direction;
+
         stop();
 
         _motor_L.set_run_mode( motor::run_mode_position );
@@ -206,33 +224,142 @@ public:
         _motor_L.set_position( 0 );
         _motor_R.set_position( 0 );
 
-        // go forward by 350
-        _motor_L.set_position_sp( 340 );
-        _motor_R.set_position_sp( 340 );
+        // go forward by 340
+        _motor_L.set_position_sp( approach_sp );
+        _motor_R.set_position_sp( approach_sp );
 
-        _motor_L.start();
-        _motor_R.start();
+        begin( Phase::Approach, approach_sp );
+    }
+
+    // advance the turn, swipe is the sweep finished in this tick (if any)
+    void step( const SwipeData &swipe ) {
+        switch ( _phase ) {
+        case Phase::Idle:
+            return;
 
-        // wait till performed
-        while (_motor_L.running() || _motor_R.running());
+        case Phase::Approach:
+            if ( !idle() )
+                return;
 
-        // turn
-        if (direction != 0) {
-            const int position_sp = 335;
+            if ( _direction == 0 ) {
+                reacquire();
+                return;
+            }
 
             std::cout << "turning" << std::endl;
 
-            _motor_L.set_position_sp( direction == -1 ? position_sp : -position_sp );
-            _motor_R.set_position_sp( direction == -1 ? -position_sp : position_sp );
+            _motor_L.set_position_sp( _direction == -1 ? rotate_sp : -rotate_sp );
+            _motor_R.set_position_sp( _direction == -1 ? -rotate_sp : rotate_sp );
+
+            begin( Phase::Rotate, rotate_sp );
+            return;
+
+        case Phase::Rotate:
+            // the position is only read once a sweep sees the line
+            if ( !idle() && !( sees_line( swipe, 20 ) && fraction() >= early_fraction ) )
+                return;
 
-            _motor_L.start();
-            _motor_R.start();
+            stop();
+            reacquire();
+            return;
 
-            // wait till performed
-            while (_motor_L.running() || _motor_R.running());
+        case Phase::Reacquire:
+            if ( sees_line( swipe, 80 ) || ++_sweeps > reacquire_sweeps )
+                _phase = Phase::Idle;
+            return;
         }
+    }
+
+    bool done() const { return _phase == Phase::Idle; }
+
+    // the line PID steers, i.e. no turn is running or it already drives
+    // forward looking for the line
+    bool steering() const { return _phase == Phase::Idle || _phase == Phase::Reacquire; }
+
+    // position() when the encoders were last reset by a turn
+    int origin() const { return _origin; }
+
+    // progress of the running turn, 0 to 1
+    float progress() const {
+        switch ( _phase ) {
+        case Phase::Approach:
+            return fraction() / 3;
+        case Phase::Rotate:
+            return ( 1 + fraction() ) / 3;
+        case Phase::Reacquire:
+            return ( 2 + std::min( 1.f, float( _sweeps ) / reacquire_sweeps ) ) / 3;
+        default:
+            return 1;
+        }
+    }
+
+    int position() {
+        return (_motor_R.position() + _motor_L.position()) / 2;
+    }
 
+    // a batch of setpoints failed, the correction is lost and the shadowed
+    // setpoints are no longer known to match the drivers
+    void drop() {
+        _motor_L.forget_setpoints();
+        _motor_R.forget_setpoints();
+        ++_dropped;
+    }
 
+    void report() const {
+        auto l = _motor_L.setpoint_writes(), r = _motor_R.setpoint_writes();
+        std::cout << "setpoint writes: " << l.issued + r.issued << " issued, "
+                  << l.skipped + r.skipped << " skipped, "
+                  << _dropped << " ticks dropped" << std::endl;
+    }
+
+protected:
+    enum class Phase { Idle, Approach, Rotate, Reacquire };
+
+    static constexpr int approach_sp = 340;
+    static constexpr int rotate_sp = 335;
+    static constexpr float early_fraction = 0.7;
+    static constexpr int reacquire_sweeps = 5;
+
+    // start motors towards their position_sp, completion is reported by the
+    // ev3dev poller thread; the counter is shared so that callbacks of an
+    // interrupted phase cannot outlive or confuse us
+    void begin( Phase phase, int distance ) {
+        abandon();
+        _phase = phase;
+        _distance = distance;
+        _start = _motor_L.position();
+
+        _motor_L.start();
+        _motor_R.start();
+
+        auto pending = std::make_shared< std::atomic< int > >( 2 );
+        _pending = pending;
+        _watch_L = _motor_L.on_idle( [pending] { --*pending; } );
+        _watch_R = _motor_R.on_idle( [pending] { --*pending; } );
+    }
+
+    // the motors were stopped or restarted before the phase finished, its
+    // watches would keep the poller busy until they go idle on their own
+    void abandon() {
+        motor::cancel_idle( _watch_L );
+        motor::cancel_idle( _watch_R );
+        _watch_L = _watch_R = 0;
+    }
+
+    bool idle() const { return *_pending == 0; }
+
+    float fraction() const {
+        return std::min( 1.f, float( std::abs( _motor_L.position() - _start ) ) / _distance );
+    }
+
+    static bool sees_line( const SwipeData &swipe, int range ) {
+        for ( const auto &p : swipe )
+            if ( p.val && std::abs( p.pos ) <= range )
+                return true;
+        return false;
+    }
+
+    void reacquire() {
         // reset position
         _motor_L.set_position( 0 );
         _motor_R.set_position( 0 );
@@ -242,13 +369,15 @@ public:
         _motor_R.set_pulses_per_second_sp( speed );
 
         forward();
-    }
 
-    int position() {
-        return (_motor_R.position() + _motor_L.position()) / 2;
+        // odometry restarts here, distances to the next crossroad count
+        // from this point
+        _origin = position();
+
+        _phase = Phase::Reacquire;
+        _sweeps = 0;
     }
 
-protected:
     void init_modes() {
         _motor_L.reset();
         _motor_R.reset();
@@ -268,6 +397,16 @@ protected:
 private:
     large_motor  _motor_L = large_motor( OUTPUT_A );
     large_motor  _motor_R = large_motor( OUTPUT_D );
+
+    Phase _phase = Phase::Idle;
+    int _direction = 0;
+    int _distance = 1;
+    int _start = 0;
+    int _sweeps = 0;
+    int _origin = 0;
+    std::shared_ptr< std::atomic< int > > _pending = std::make_shared< std::atomic< int > >( 0 );
+    motor::idle_watch _watch_L = 0, _watch_R = 0;
+    long _dropped = 0;
 };
 
 
@@ -279,19 +418,25 @@ public:
         _crossroad( &crossroad ), _drives( &drives )
     { }
 
+    // swipes which never reached the crossroad analysis, to size HISTORY_SIZE
+    void report() const {
+        const auto &h = _history.first;
+        std::cout << "swipe history: " << std::max( _history_high, h.high_water() )
+                  << " of " << h.capacity() << " used at most, "
+                  << _history_dropped + h.dropped() << " overwritten" << std::endl;
+    }
+
     int process( SwipeData& swipe ) {
 
-        auto cross = _crossroad->result.tryCopyOut();
-        if ( cross.first ) { // results are valid
+        int direction = 0;
+        if ( _crossroad->result.tryRead( [&]( int &d ) { direction = d; } ) ) { // results are valid
             // do crossroad
 
             // exit if in target
-            if (cross.second == -2)
+            if (direction == -2)
                 exit(0);
 
-            _drives->turn(cross.second);
-
-            _oldpos = _drives->position();
+            _drives->turn(direction);
             return 0;
         }
 
@@ -351,10 +496,17 @@ public:
             _was_wider = false;
             // dispatch a new job for crosroad analysis
             int position = _drives->position();
-//            std::cout << "widening, distance = " << _oldpos - position << std::endl;
-            int dist = (_oldpos - position);
+//            std::cout << "widening, distance = " << _drives->origin() - position << std::endl;
+            int dist = (_drives->origin() - position);
             _history.second = std::ceil(float(dist) / float(320));
-            _crossroad->data.assign( _history );
+            // count per handed-over history and sum here, whatever storage
+            // the mailbox swaps back in
+            _history_dropped += _history.first.dropped();
+            _history_high = std::max( _history_high, _history.first.high_water() );
+            _crossroad->data.publish( _history );
+            // what comes back is an older history (or nothing), start afresh
+            _history.first.clear();
+            _history.first.reset_stats();
             _last_width.clear();
         }
 
@@ -428,11 +580,12 @@ protected:
 private:
     std::vector<int>    _temp;
     PID                 _linePid = PID( 0.5, 10, 15, 100, 0 );
-    Buffer< int >       _last_width = { 3 };
+    Buffer< int, 3 >    _last_width;
     CrossroadAnalyzer  *_crossroad = nullptr;
     DriveControl       *_drives = nullptr;
-    std::pair< Buffer< SwipeData >, int > _history = { { HISTORY_SIZE }, 0 };
-    int _oldpos = 0;
+    std::pair< SwipeHistory, int > _history = { {}, 0 };
+    long _history_dropped = 0; // of buffers handed over to _crossroad
+    int _history_high = 0;
     bool _was_wider = false;
 };
 
@@ -450,24 +603,52 @@ struct KillSwitch {
 
     void run() {
         while ( !killFlag ) {
-            if ( _button.value() > 0 ) {
-                killFlag = true;
-                std::cout << "killed" << std::endl;
-            } else
-                std::this_thread::sleep_for( 100ms );
+            int pressed = 0;
+            if ( !_button.try_value( 0, pressed ) && pressed > 0 )
+                kill( now() );
+            else // touch sensor is not an input device, it has to be polled
+                std::this_thread::sleep_for( 10ms );
         }
     }
 
     void spawn() {
         assert( !_thr.joinable() );
+
+        // back button of the brick stops the robot directly from the input
+        // reader thread, as soon as the kernel reports the key
+        input_events::instance().on_key( []( const input_events::event &e ) {
+                if ( e.code == KEY_BACKSPACE && e.pressed )
+                    kill( e.time_us );
+            } );
+
         _thr = std::thread( [&] { this->run(); } );
     }
 
+    // time from the kill event to setting killFlag
+    static long latency_us() { return _latency; }
+
   private:
+    static long now() {
+        using namespace std::chrono;
+        return duration_cast< microseconds >( steady_clock::now().time_since_epoch() ).count();
+    }
+
+    static void kill( long event_us ) {
+        ev3dev::estop::trigger();
+        if ( killFlag.exchange( true ) )
+            return;
+        _latency = now() - event_us;
+        std::cout << "killed" << std::endl;
+    }
+
+    static std::atomic< long > _latency;
+
     ev3dev::touch_sensor _button;
     std::thread _thr;
 };
 
+std::atomic< long > KillSwitch::_latency{ -1 };
+
 
 
 class SensorControl {
@@ -486,45 +667,38 @@ public:
         _motor.set_position_mode( motor::position_mode_absolute );
 
         _motor.set_position( 0 );
-    }
-
-
-    void update(SwipeData& data) {
-        const int intensity = _eye.value(0) + _eye.value(1) + _eye.value(2);
 
-        DataPoint point;
-        point.pos = _motor.position();
-        point.val = (intensity < 382) ? 1 : 0;
+        _sampler.spawn();
+    }
 
-        _data.push_back(point);
 
-        if (update_motor()) {
-            _data.swap(data);
-            _data.clear();
-        }
+    void stop() {
+        _sampler.stop();
+        _motor.stop();
     }
 
-protected:
-    bool update_motor() {
-        if ( _motor.running() )
-            return false;
+    // take one whole sweep recorded by the sampler thread, returns false if
+    // none was finished in time
+    bool update(SwipeData& data) {
+        return _sampler.takeSweep( [&]( const Sample &s ) {
+                const int intensity = s.rgb[0] + s.rgb[1] + s.rgb[2];
 
-        int pos_sp = ( _motor.position_sp() < 0 ) ? _limit_ccw : _limit_cw;
+                DataPoint point;
+                point.pos = s.pos;
+                point.val = (intensity < 382) ? 1 : 0;
 
-        _motor.set_position_sp( pos_sp );
-        _motor.start();
-
-        return true;
+                data.push_back(point);
+            }, 20ms );
     }
 
-private:
-    SwipeData _data;
-
-    int _limit_ccw = 80;
-    int _limit_cw = -80;
+    long dropped() const { return _sampler.dropped(); }
+    const io_batch &io() const { return _sampler.io(); }
 
+private:
     color_sensor _eye = color_sensor( INPUT_AUTO );
     medium_motor _motor = medium_motor( OUTPUT_AUTO );
+
+    Sampler _sampler = { _eye, _motor, 80, -80 };
 };
 
 class MainControl {
@@ -546,21 +720,56 @@ public:
         _crossroad.data.cancelWaits();
         _crossroad.result.cancelWaits();
         _crossroadThr.join();
+        _sensors.stop();
         _drives.stop();
+
+        if ( _swipes )
+            std::cout << "samples per sweep: " << float( _samples ) / _swipes
+                      << " (" << _sensors.dropped() << " dropped)" << std::endl;
+        _drives.report();
+        _analyzer.report();
+
+        report( "drives", _io );
+        report( "sensors", _sensors.io() );
+    }
+
+    static void report( const char *what, const io_batch &batch ) {
+        auto &io = batch.statistics();
+        if ( io.ticks )
+            std::cout << "io " << what << " (" << ( batch.uses_uring() ? "io_uring" : "pread" ) << "): "
+                      << float( io.syscalls ) / io.ticks << " syscalls/tick, "
+                      << io.total_ns / io.ticks / 1000 << " us/tick avg, "
+                      << io.max_ns / 1000 << " us max" << std::endl;
     }
 
 protected:
     void update() {
         _swipe.clear();
-        _sensors.update(_swipe);
-        if (!_swipe.empty()) {
+        const bool swept = _sensors.update(_swipe);
+        if (swept) {
+            ++_swipes;
+            _samples += _swipe.size();
+        }
+
+        // sampling goes on during turns, while approaching and rotating sweeps
+        // only serve to find the line, once the robot drives forward again
+        // the PID steers towards it
+        if (!_drives.done())
+            _drives.step(_swipe);
+
+        if (swept && _drives.steering()) {
             int correction = _analyzer.process(_swipe);
-            _drives.adjust( correction );
+            if (_drives.steering()) {
+                _drives.adjust( correction, _io );
+                if ( !_io.submit() )
+                    _drives.drop();
+            }
         }
     }
 
 private:
     SwipeData     _swipe;
+    io_batch      _io;
     CrossroadAnalyzer _crossroad;
     std::thread _crossroadThr;
 
@@ -568,6 +777,9 @@ private:
     DriveControl  _drives;
 
     SwipeAnalyzer _analyzer = { _crossroad, _drives };
+
+    long _swipes = 0;
+    long _samples = 0;
 };
 
 
@@ -575,9 +787,10 @@ private:
 int main() {
     // stop control loop on signal
     killFlag = false;
-    std::signal( SIGINT, []( int ) { killFlag = true; } );
+    std::signal( SIGINT, []( int ) { ev3dev::estop::trigger(); killFlag = true; } );
 
     MainControl bot;
+    ev3dev::estop::arm();
     KillSwitch killSwith;
 
     if ( !bot.check() )
@@ -586,6 +799,9 @@ int main() {
     killSwith.spawn();
     bot.run();
 
+    if ( KillSwitch::latency_us() >= 0 )
+        std::cout << "kill latency: " << KillSwitch::latency_us() << " us" << std::endl;
+
     return 0;
 error:
     std::cout << "miscount detected!" << std::endl;
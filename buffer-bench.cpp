@@ -0,0 +1,190 @@
+#include "buffer.h"
+#include <chrono>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <atomic>
+
+// Throughput of Buffer, with runtime and compile-time capacity, against the
+// modulo-indexed ring it replaced. Prints one CSV line per benchmark:
+//     benchmark,impl,ns_per_op,ops
+
+// the previous Buffer: one slot kept free, indices wrapped with modulo
+template< typename T >
+struct ModuloBuffer {
+    ModuloBuffer( int size ) : _size( size + 1 ), _read( 0 ), _write( 0 ), _data( new T[ _size ] ) { }
+
+    struct Iterator {
+        Iterator( const ModuloBuffer *self, int ix ) : _self( self ), _ix( ix ) { }
+        const T &operator*() const { return _self->_data.get()[ _ix ]; }
+        Iterator &operator++() { _ix = _self->_nxt( _ix ); return *this; }
+        bool operator!=( Iterator o ) const { return _ix != o._ix; }
+        const ModuloBuffer *_self;
+        int _ix;
+    };
+
+    Iterator begin() const { return Iterator( this, _read ); }
+    Iterator end() const { return Iterator( this, _write ); }
+
+    void push_back( const T &val ) {
+        auto nwrite = _nxt( _write );
+        if ( nwrite == _read )
+            _read = _nxt( _read );
+        _data.get()[ _write ] = val;
+        _write = nwrite;
+    }
+
+    const T &operator[]( int ix ) const { return _data.get()[ _nxt( _read, ix ) ]; }
+    int size() const { return (_write + _size - _read) % _size; }
+
+    int _nxt( int x, int ix = 1 ) const { return (((x + ix) % _size) + _size) % _size; }
+
+    const int _size;
+    int _read, _write;
+    std::unique_ptr< T[] > _data;
+};
+
+volatile long sink;
+
+template< typename Op >
+void bench( const char *name, const char *impl, long ops, Op op ) {
+    using namespace std::chrono;
+    const auto start = steady_clock::now();
+    op();
+    const auto ns = duration_cast< nanoseconds >( steady_clock::now() - start ).count();
+    std::cout << name << "," << impl << "," << double( ns ) / ops << "," << ops << std::endl;
+}
+
+template< typename Buf >
+void run( const char *impl, int capacity ) {
+    const long pushes = 20 * 1000 * 1000;
+    const std::string suffix = "_" + std::to_string( capacity );
+
+    Buf buf( capacity );
+    bench( ( "push_back" + suffix ).c_str(), impl, pushes, [&] {
+            for ( long i = 0; i < pushes; ++i )
+                buf.push_back( int( i ) );
+        } );
+
+    const long rounds = pushes / capacity;
+    bench( ( "iterate" + suffix ).c_str(), impl, rounds * capacity, [&] {
+            long sum = 0;
+            for ( long r = 0; r < rounds; ++r )
+                for ( auto x : buf )
+                    sum += x;
+            sink = sum;
+        } );
+
+    bench( ( "index" + suffix ).c_str(), impl, rounds * capacity, [&] {
+            long sum = 0;
+            for ( long r = 0; r < rounds; ++r )
+                for ( int i = 0, n = buf.size(); i < n; ++i )
+                    sum += buf[ i ];
+            sink = sum;
+        } );
+}
+
+// iterates Buffer over its contiguous spans rather than its iterators
+void runSpans( int capacity ) {
+    const long pushes = 20 * 1000 * 1000;
+    Buffer< int > buf( capacity );
+    for ( int i = 0; i < capacity + capacity / 2; ++i ) // wrap around
+        buf.push_back( i );
+
+    const long rounds = pushes / capacity;
+    bench( ( "iterate_" + std::to_string( capacity ) ).c_str(), "spans", rounds * capacity, [&] {
+            long sum = 0;
+            for ( long r = 0; r < rounds; ++r ) {
+                const auto spans = buf.as_spans();
+                for ( auto x : spans.first )
+                    sum += x;
+                for ( auto x : spans.second )
+                    sum += x;
+            }
+            sink = sum;
+        } );
+}
+
+// copies a full, wrapped Buffer, element by element as the copy constructor
+// did and with the constructor itself (memcpy of its spans)
+void runCopy( int capacity ) {
+    const long elements = 50 * 1000 * 1000;
+    const std::string name = "copy_" + std::to_string( capacity );
+    Buffer< int > buf( capacity );
+    for ( int i = 0; i < capacity + capacity / 2; ++i )
+        buf.push_back( i );
+
+    const long rounds = elements / capacity;
+    bench( name.c_str(), "elementwise", rounds * capacity, [&] {
+            long sum = 0;
+            for ( long r = 0; r < rounds; ++r ) {
+                Buffer< int > copy( capacity );
+                std::copy( buf.begin(), buf.end(), std::back_inserter( copy ) );
+                sum += copy.back();
+            }
+            sink = sum;
+        } );
+    bench( name.c_str(), "memcpy", rounds * capacity, [&] {
+            long sum = 0;
+            for ( long r = 0; r < rounds; ++r ) {
+                Buffer< int > copy( buf );
+                sum += copy.back();
+            }
+            sink = sum;
+        } );
+}
+
+// streams ints from one thread to another, through SpscBuffer and through
+// Buffer under a mutex as GuardedVar would, reports time per pushed element
+template< typename Push, typename Pop >
+void stream( const char *impl, Push push, Pop pop ) {
+    const long pushes = 5 * 1000 * 1000;
+    std::atomic< bool > done{ false };
+    long got = 0;
+    bench( "stream", impl, pushes, [&] {
+            std::thread consumer( [&] {
+                    int x;
+                    while ( !done.load( std::memory_order_acquire ) )
+                        got += pop( x );
+                    while ( pop( x ) )
+                        ++got;
+                } );
+            for ( long i = 0; i < pushes; ++i )
+                push( int( i ) );
+            done = true;
+            consumer.join();
+        } );
+    sink = got;
+}
+
+int main() {
+    std::cout << "benchmark,impl,ns_per_op,ops" << std::endl;
+    for ( int capacity : { 9, 1000 } ) { // HISTORY_SIZE and a sample log
+        run< ModuloBuffer< int > >( "modulo", capacity );
+        run< Buffer< int > >( "masked", capacity );
+        runSpans( capacity );
+    }
+    run< Buffer< int, 9 > >( "static", 9 );
+    run< Buffer< int, 1000 > >( "static", 1000 );
+    runCopy( 9 );
+    runCopy( 1000 );
+
+    SpscBuffer< int > spsc( 1000 );
+    stream( "spsc", [&]( int x ) { spsc.push_back( x ); },
+            [&]( int &x ) { return spsc.pop_front( x ); } );
+
+    Buffer< int > locked( 1000 );
+    std::mutex mutex;
+    stream( "mutex", [&]( int x ) {
+                std::lock_guard< std::mutex > g( mutex );
+                locked.push_back( x );
+            }, [&]( int &x ) {
+                std::lock_guard< std::mutex > g( mutex );
+                if ( locked.empty() )
+                    return false;
+                x = locked.front();
+                locked.pop_front();
+                return true;
+            } );
+}
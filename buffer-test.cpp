@@ -1,4 +1,20 @@
 #include "buffer.h"
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#undef NDEBUG // the checks run in release builds (MODE=Release) too
+#include <cassert>
+
+// counts its live instances
+struct Live {
+    static int count;
+    Live( int v = 0 ) : v( v ) { ++count; }
+    Live( const Live &o ) : v( o.v ) { ++count; }
+    Live &operator=( const Live & ) = default;
+    ~Live() { --count; }
+    int v;
+};
+int Live::count = 0;
 
 int main() {
     Buffer< int > buf( 16 );
@@ -65,4 +81,204 @@ int main() {
             assert( x == i++ );
         assert( i == 23 );
     }
+
+    // capacity which is not a power of two, storage is larger than capacity
+    Buffer< int > odd( 9 );
+    assert( odd.capacity() == 9 );
+    for ( int i = 0; i < 100; ++i ) {
+        odd.push_back( i );
+        assert( odd.size() == std::min( i + 1, 9 ) );
+        assert( odd.back() == i );
+        assert( odd.front() == std::max( 0, i - 8 ) );
+    }
+    {
+        int i = 91;
+        for ( auto x : odd )
+            assert( x == i++ );
+        assert( i == 100 );
+        for ( auto x : reverseRange( odd ) )
+            assert( x == --i );
+        assert( i == 91 );
+    }
+
+    // only elements in the buffer are alive
+    {
+        Buffer< Live > live( 5 );
+        assert( Live::count == 0 );
+        for ( int i = 0; i < 20; ++i ) {
+            if ( i % 2 )
+                live.push_back( Live( i ) );
+            else
+                live.emplace_back( i );
+            assert( Live::count == live.size() );
+            assert( live.back().v == i );
+        }
+        live.pop_front();
+        live.pop_back();
+        assert( Live::count == 3 );
+        assert( live.front().v == 16 && live.back().v == 18 );
+        Buffer< Live > copy( live );
+        assert( Live::count == 6 );
+        live.clear();
+        assert( Live::count == 3 && live.empty() );
+        Buffer< Live > moved( std::move( copy ) );
+        assert( Live::count == 3 );
+    }
+    assert( Live::count == 0 );
+
+    // copying into a full buffer reuses the dropped vector
+    {
+        Buffer< std::vector< int > > vecs( 3 );
+        for ( int i = 0; i < 3; ++i )
+            vecs.push_back( std::vector< int >( 100, i ) );
+        for ( int i = 3; i < 10; ++i ) {
+            const int *oldest = vecs.front().data();
+            const std::vector< int > v( 50, i );
+            vecs.push_back( v );
+            assert( vecs.back().data() == oldest );
+            assert( vecs.back().size() == 50 && vecs.back()[ 0 ] == i );
+            assert( vecs.front()[ 0 ] == i - 2 );
+        }
+    }
+
+    // random access, on a buffer which has wrapped around
+    {
+        Buffer< int > ra( 9 );
+        for ( int i = 0; i < 23; ++i )
+            ra.push_back( ( i * 7 ) % 23 );
+        assert( ra.end() - ra.begin() == 9 );
+        assert( std::distance( ra.begin(), ra.end() ) == 9 );
+        assert( ra.begin() < ra.end() && ra.begin() + 9 == ra.end() );
+        assert( ra.begin()[ 4 ] == ra[ 4 ] && *( ra.end() - 1 ) == ra.back() );
+
+        std::vector< int > sorted( ra.begin(), ra.end() );
+        std::sort( sorted.begin(), sorted.end() );
+        std::sort( ra.begin(), ra.end() );
+        assert( std::equal( ra.begin(), ra.end(), sorted.begin() ) );
+        assert( std::binary_search( ra.cbegin(), ra.cend(), sorted[ 5 ] ) );
+        assert( std::lower_bound( ra.begin(), ra.end(), sorted[ 3 ] ) - ra.begin() == 3 );
+
+        std::reverse( ra.begin(), ra.end() );
+        std::nth_element( ra.begin(), ra.begin() + 4, ra.end() );
+        assert( ra[ 4 ] == sorted[ 4 ] );
+    }
+
+    // contiguous spans cover the elements in order
+    {
+        Buffer< int > sp( 9 ); // storage of 16
+        for ( int n = 0; n < 40; ++n ) {
+            const auto spans = sp.as_spans();
+            assert( spans.first.size() + spans.second.size() == sp.size() );
+            assert( !spans.first.empty() || spans.second.empty() );
+            std::vector< int > joined( spans.first.begin(), spans.first.end() );
+            joined.insert( joined.end(), spans.second.begin(), spans.second.end() );
+            assert( std::equal( joined.begin(), joined.end(), sp.begin() ) );
+            sp.push_back( n );
+        }
+        const Buffer< int > &csp = sp;
+        assert( csp.as_spans().first.data() == &csp.front() );
+    }
+
+    // capacity known at compile time, slots stored inline
+    {
+        static_assert( BufferSlots< int, 9 >::capacity() == 9, "capacity is constexpr" );
+        static_assert( sizeof( Buffer< int, 9 > ) >= 16 * sizeof( int ), "slots are inline" );
+        Buffer< Live, 3 > a, b;
+        assert( a.capacity() == 3 );
+        for ( int i = 0; i < 7; ++i )
+            a.push_back( Live( i ) );
+        b.emplace_back( 42 );
+        assert( Live::count == 4 );
+        assert( a.front().v == 4 && a.back().v == 6 );
+
+        std::swap( a, b );
+        assert( Live::count == 4 );
+        assert( a.size() == 1 && a.front().v == 42 );
+        assert( b.size() == 3 && b.front().v == 4 && b.back().v == 6 );
+
+        Buffer< Live, 3 > c( std::move( b ) );
+        assert( b.empty() && c.size() == 3 && c[ 1 ].v == 5 );
+        assert( Live::count == 4 );
+        a = std::move( c );
+        assert( a.size() == 3 && c.size() == 1 && c.front().v == 42 );
+
+        Buffer< Live, 3 > d( a );
+        assert( std::equal( d.begin(), d.end(), a.begin(),
+                            []( const Live &x, const Live &y ) { return x.v == y.v; } ) );
+        assert( Live::count == 7 );
+    }
+    assert( Live::count == 0 );
+
+    // bulk pushes, memcpy for ints and element-wise for vectors
+    {
+        std::vector< int > src( 30 );
+        std::iota( src.begin(), src.end(), 0 );
+        Buffer< int > bulk( 9 ); // storage of 16
+        for ( int i = 0; i < 12; ++i )
+            bulk.push_back( -1 );
+        bulk.push_range( src.data(), src.data() + 5 ); // wraps around
+        assert( bulk.size() == 9 && bulk[ 3 ] == -1 && bulk[ 4 ] == 0 && bulk.back() == 4 );
+        bulk.push_range( src.data() + 5, src.data() + 30 ); // more than capacity
+        assert( bulk.size() == 9 );
+        assert( std::equal( bulk.begin(), bulk.end(), src.begin() + 21 ) );
+        bulk.assign_range( src.cbegin(), src.cbegin() + 3 ); // not a pointer
+        assert( bulk.size() == 3 && bulk.front() == 0 && bulk.back() == 2 );
+
+        Buffer< int > copy( bulk ), other( 9 );
+        assert( std::equal( copy.begin(), copy.end(), bulk.begin(), bulk.end() ) );
+        other.push_range( src.data(), src.data() + 30 );
+        other = copy; // replaces
+        assert( std::equal( other.begin(), other.end(), bulk.begin(), bulk.end() ) );
+
+        Buffer< std::vector< int >, 3 > vecs;
+        const std::vector< int > vsrc[] = { { 1 }, { 2, 2 }, { 3 }, { 4 } };
+        vecs.push_range( vsrc, vsrc + 4 );
+        assert( vecs.size() == 3 && vecs.front() == vsrc[ 1 ] && vecs.back() == vsrc[ 3 ] );
+        Buffer< std::vector< int >, 3 > vcopy( vecs );
+        assert( std::equal( vcopy.begin(), vcopy.end(), vecs.begin(), vecs.end() ) );
+    }
+
+    // overflow policies and their counters
+    {
+        Buffer< int > over( 4 );
+        for ( int i = 0; i < 10; ++i ) {
+            const bool pushed = over.push_back( i );
+            assert( pushed );
+        }
+        assert( over.dropped() == 6 && over.high_water() == 4 && over.front() == 6 );
+        const int src[] = { 10, 11, 12, 13, 14, 15 };
+        over.push_range( src, src + 6 );
+        assert( over.dropped() == 12 && over.front() == 12 );
+        over.clear();
+        assert( over.dropped() == 12 && over.high_water() == 4 );
+        over.push_back( 1 );
+        over.reset_stats();
+        assert( over.dropped() == 0 && over.high_water() == 1 );
+
+        Buffer< Live, 3, BufferOverflow::Reject > reject;
+        for ( int i = 0; i < 5; ++i ) {
+            const bool pushed = reject.emplace_back( i );
+            assert( pushed == ( i < 3 ) );
+        }
+        assert( reject.dropped() == 2 && reject.back().v == 2 && Live::count == 3 );
+        reject.pop_front();
+        Buffer< int, 3, BufferOverflow::Reject > rejectInts;
+        rejectInts.push_range( src, src + 6 );
+        assert( rejectInts.size() == 3 && rejectInts.back() == 12 && rejectInts.dropped() == 3 );
+
+        Buffer< std::vector< int >, 0, BufferOverflow::Grow > grow( 2 );
+        for ( int i = 0; i < 9; ++i ) {
+            const bool pushed = grow.push_back( std::vector< int >( 3, i ) );
+            assert( pushed );
+        }
+        assert( grow.size() == 9 && grow.capacity() == 16 && grow.dropped() == 0 );
+        for ( int i = 0; i < 9; ++i )
+            assert( grow[ i ] == std::vector< int >( 3, i ) );
+        Buffer< int, 0, BufferOverflow::Grow > growInts( 4 );
+        growInts.push_back( 1 );
+        growInts.push_range( src, src + 6 );
+        assert( growInts.size() == 7 && growInts.capacity() == 8 && growInts.high_water() == 7 );
+        assert( growInts.front() == 1 && growInts.back() == 15 );
+    }
+    assert( Live::count == 0 );
 }
@@ -1,5 +1,11 @@
 #include <memory>
+#include <algorithm>
+#include <iterator>
 #include <utility>
+#include <type_traits>
+#include <new>
+#include <atomic>
+#include <cstring>
 #include <cassert>
 
 #ifndef _BUFFER_H
@@ -19,18 +25,96 @@ auto reverseRange( Col &col ) {
     return RR( &col );
 }
 
+// power of two which holds size elements
+constexpr unsigned bufferStorage( unsigned size ) {
+    unsigned s = 1;
+    while ( s < size )
+        s <<= 1;
+    return s;
+}
+
+// Slots of Buffer< T, N >: inline for N elements known at compile time...
+template< typename T, int N >
+struct BufferSlots {
+    using Slot = typename std::aligned_storage< sizeof( T ), alignof( T ) >::type;
+    static constexpr bool isInline = true;
+
+    BufferSlots( int size = N ) { assert( size == N ); static_cast< void >( size ); }
+    BufferSlots( BufferSlots && ) { } // elements are moved by Buffer
+
+    static constexpr int capacity() { return N; }
+    static constexpr unsigned mask() { return bufferStorage( N ) - 1; }
+    Slot *data() { return _data; }
+    const Slot *data() const { return _data; }
+
+  private:
+    Slot _data[ bufferStorage( N ) ];
+};
+
+// ...or on the heap for size given at runtime (N = 0)
 template< typename T >
+struct BufferSlots< T, 0 > {
+    using Slot = typename std::aligned_storage< sizeof( T ), alignof( T ) >::type;
+    static constexpr bool isInline = false;
+
+    BufferSlots( int size ) :
+        _size( size ), _mask( bufferStorage( size ) - 1 ), _data( new Slot[ _mask + 1 ] )
+    { }
+
+    int capacity() const { return _size; }
+    unsigned mask() const { return _mask; }
+    Slot *data() { return _data.get(); }
+    const Slot *data() const { return _data.get(); }
+
+    void swap( BufferSlots &o ) {
+        std::swap( _size, o._size );
+        std::swap( _mask, o._mask );
+        std::swap( _data, o._data );
+    }
+
+  private:
+    int _size;      // capacity
+    unsigned _mask; // storage size - 1
+    std::unique_ptr< Slot[] > _data;
+};
+
+// what pushing into a full Buffer does
+enum class BufferOverflow {
+    Overwrite, // drops the oldest element
+    Reject,    // drops the new one
+    Grow       // doubles the capacity, only for capacity given at runtime
+};
+
+// Ring of at most size elements, pushing into a full buffer drops the oldest
+// one. Storage is rounded up to a power of two and elements are addressed by
+// free-running read and write counters masked into it, so that no division
+// is needed (the ARMv5 of the brick has no divide instruction). Slots are raw
+// storage, only elements in the buffer are alive. push_back into a full
+// buffer reuses the dropped element (and e.g. the capacity of a vector) for
+// the new one instead of destroying it. With N given, the capacity is known
+// at compile time and the slots are stored inline, without allocation.
+//
+// The overflow policy P can also reject new elements or grow the buffer
+// instead. Each buffer counts the elements it dropped and the largest size it
+// reached, so that its capacity can be chosen from data; the counters belong
+// to the object and are not exchanged by swap or moves.
+template< typename T, int N = 0, BufferOverflow P = BufferOverflow::Overwrite >
 struct Buffer {
+    static_assert( P != BufferOverflow::Grow || N == 0, "inline slots can't grow" );
+
     using value_type = T;
 
     template< typename SelfPtr, typename ValRef >
-    struct Iterator : std::iterator< std::bidirectional_iterator_tag, T > {
-        Iterator( SelfPtr self, int ix ) : _self( self ), _ix( ix ) { }
+    struct Iterator : std::iterator< std::random_access_iterator_tag, T, int > {
+        Iterator() : _self( nullptr ), _pos( 0 ) { }
+        Iterator( SelfPtr self, unsigned pos ) : _self( self ), _pos( pos ) { }
 
-        ValRef operator *() { return _self->_data.get()[ _ix ]; }
+        ValRef operator *() const { return _self->_at( _pos ); }
+        auto operator->() const { return &_self->_at( _pos ); }
+        ValRef operator[]( int n ) const { return _self->_at( _pos + n ); }
 
         Iterator &operator++() {
-            _ix = _self->_nxt( _ix );
+            ++_pos;
             return *this;
         }
 
@@ -41,7 +125,7 @@ struct Buffer {
         }
 
         Iterator &operator--() {
-            _ix = _self->_nxt( _ix, -1 );
+            --_pos;
             return *this;
         }
 
@@ -51,41 +135,80 @@ struct Buffer {
             return copy;
         }
 
-        bool operator==( Iterator o ) const { return _self == o._self && _ix == o._ix; }
+        Iterator &operator+=( int n ) {
+            _pos += n;
+            return *this;
+        }
+
+        Iterator &operator-=( int n ) {
+            _pos -= n;
+            return *this;
+        }
+
+        Iterator operator+( int n ) const { return Iterator( _self, _pos + n ); }
+        Iterator operator-( int n ) const { return Iterator( _self, _pos - n ); }
+        friend Iterator operator+( int n, Iterator it ) { return it + n; }
+
+        // counters wrap around, their difference does not
+        int operator-( Iterator o ) const { return int( _pos - o._pos ); }
+
+        bool operator==( Iterator o ) const { return _self == o._self && _pos == o._pos; }
         bool operator!=( Iterator o ) const { return !(*this == o); }
+        bool operator<( Iterator o ) const { return *this - o < 0; }
+        bool operator>( Iterator o ) const { return o < *this; }
+        bool operator<=( Iterator o ) const { return !(o < *this); }
+        bool operator>=( Iterator o ) const { return !(*this < o); }
 
       private:
         SelfPtr _self;
-        int _ix;
+        unsigned _pos; // counter value, not masked
+    };
+
+    // contiguous run of elements, see as_spans
+    template< typename V >
+    struct Span {
+        V *data() const { return _data; }
+        int size() const { return _len; }
+        bool empty() const { return _len == 0; }
+        V *begin() const { return _data; }
+        V *end() const { return _data + _len; }
+
+        V *_data;
+        int _len;
     };
 
-    using iterator = Iterator< Buffer< T > *, T & >;
-    using const_iterator = Iterator< const Buffer< T > *, const T & >;
+    using iterator = Iterator< Buffer *, T & >;
+    using const_iterator = Iterator< const Buffer *, const T & >;
     using reverse_iterator = std::reverse_iterator< iterator >;
     using const_reverse_iterator = std::reverse_iterator< const_iterator >;
 
-    Buffer( int size ) :
-        _size( size + 1 ), _read( 0 ), _write( 0 ),
-        _data( new T[ _size ] )
-    { }
+    // size is given by N unless it is 0
+    Buffer( int size = N ) : _slots( size ), _read( 0 ), _write( 0 ) { }
+
+    ~Buffer() {
+        if ( _slots.data() )
+            clear();
+    }
 
-    Buffer( const Buffer &o ) : Buffer( o._size - 1 ) {
-        std::copy( o.begin(), o.end(), std::back_inserter( *this ) );
+    Buffer( const Buffer &o ) : Buffer( o.capacity() ) {
+        _append( o );
     }
 
-    Buffer( Buffer &&o ) :
-        _size( o._size ), _read( o._read ), _write( o._write ), _data( o._data.release() )
-    { } // only operation alloved on o after this ctor is called is dtor
+    // heap slots are taken over, after which the only operation allowed on o
+    // is dtor; inline elements are moved one by one and o is left empty
+    Buffer( Buffer &&o ) : _slots( std::move( o._slots ) ), _read( 0 ), _write( 0 ) {
+        _take( o, std::integral_constant< bool, Slots::isInline >() );
+    }
 
     Buffer &operator=( const Buffer &o ) {
         if ( &o == this )
             return *this;
 
-        assert( _size == o._size );
-        assert( _data );
+        assert( capacity() == o.capacity() );
+        assert( _slots.data() );
 
-        // insert new
-        std::copy( o.begin(), o.end(), std::back_inserter( *this ) );
+        clear();
+        _append( o );
         return *this;
     }
 
@@ -93,58 +216,101 @@ struct Buffer {
         if ( &o == this )
             return *this;
 
-        swap( *this, o );
+        swap( o );
         return *this;
     }
 
     void swap( Buffer &o ) {
-        assert( _size == o._size );
-        std::swap( _read, o._read );
-        std::swap( _write, o._write );
-        std::swap( _data, o._data );
+        _swap( o, std::integral_constant< bool, Slots::isInline >() );
+    }
+
+    // false if the element was rejected
+    bool push_back( const T &val ) { return _push_back( val ); }
+    bool push_back( T &&val ) { return _push_back( std::move( val ) ); }
+
+    // pushes the elements of [first, last) in order, a range of trivially
+    // copyable elements in contiguous memory is copied with memcpy
+    template< typename It >
+    void push_range( It first, It last ) {
+        using Contiguous = std::integral_constant< bool,
+                std::is_trivially_copyable< T >::value && std::is_pointer< It >::value
+                && std::is_same< typename std::remove_cv< typename std::remove_pointer< It >::type >::type,
+                                 T >::value >;
+        _push_range( first, last, Contiguous() );
     }
 
-    void push_back( const T &val ) { _push_back( [&]( T *to ) { *to = val; } ); }
-    void push_back( T &&val ) { _push_back( [&]( T *to ) { *to = std::move( val ); } ); }
+    // replaces the content with [first, last)
+    template< typename It >
+    void assign_range( It first, It last ) {
+        clear();
+        push_range( first, last );
+    }
+
+    // constructs the new element in place, on overwrite the oldest element is
+    // destroyed; false if the element was rejected
+    template< typename... Args >
+    bool emplace_back( Args &&...args ) {
+        if ( !_room( 1 ) )
+            return false;
+        new ( _slot( _write ) ) T( std::forward< Args >( args )... );
+        ++_write;
+        _noteSize();
+        return true;
+    }
 
     void pop_back() {
         assert( _read != _write );
-        _write = _nxt( _write, -1 );
+        _at( --_write ).~T();
     }
 
     void pop_front() {
         assert( _read != _write );
-        _read = _nxt( _read );
+        _at( _read++ ).~T();
     }
 
     bool empty() const { return _read == _write; }
 
     void clear() {
+        while ( !empty() )
+            pop_front();
         _read = _write = 0;
     }
 
     // oldest element
     T &front() {
         assert( !empty() );
-        return _data.get()[ _read ];
+        return _at( _read );
     }
     const T &front() const {
         assert( !empty() );
-        return _data.get()[ _read ];
+        return _at( _read );
     }
 
     // newest element
     T &back() {
         assert( !empty() );
-        return _data.get()[ _nxt( _write, -1 ) ];
+        return _at( _write - 1 );
     }
 
     const T &back() const {
         assert( !empty() );
-        return _data.get()[ _nxt( _write, -1 ) ];
+        return _at( _write - 1 );
     }
 
-    int size() const { return (_write + _size - _read) % _size; }
+    int size() const { return _write - _read; }
+    int capacity() const { return _slots.capacity(); }
+
+    // elements overwritten or rejected since construction (or reset_stats)
+    long dropped() const { return _dropped; }
+    // largest size since construction (or reset_stats)
+    int high_water() const { return _highWater; }
+
+    // restarts the counters, e.g. when the buffer is handed over to another
+    // owner who keeps counting on its own
+    void reset_stats() {
+        _dropped = 0;
+        _highWater = size();
+    }
 
     iterator begin() { return iterator( this, _read ); }
     const_iterator begin() const { return const_iterator( this, _read ); }
@@ -162,35 +328,250 @@ struct Buffer {
     const_reverse_iterator rend() const { return const_reverse_iterator( begin() ); }
     const_reverse_iterator crend() const { return rend(); }
 
-    T &operator[]( int ix ) { return _data.get()[ _nxt( _read, ix ) ]; }
-    const T &operator[]( int ix ) const { return _data.get()[ _nxt( _read, ix ) ]; }
+    T &operator[]( int ix ) { return _at( _read + ix ); }
+    const T &operator[]( int ix ) const { return _at( _read + ix ); }
+
+    // the elements from the oldest to the newest as at most two contiguous
+    // runs of storage, the second one is empty unless the ring wraps around
+    std::pair< Span< T >, Span< T > > as_spans() { return _spans< T >( this ); }
+    std::pair< Span< const T >, Span< const T > > as_spans() const { return _spans< const T >( this ); }
 
   private:
-    const int _size;
-    int _read;
-    int _write;
-    std::unique_ptr< T[] > _data;
+    using Slots = BufferSlots< T, N >;
+
+    Slots _slots;
+    unsigned _read;       // free-running, wrap around together
+    unsigned _write;
+    long _dropped = 0;
+    int _highWater = 0;
+
+    using CanGrow = std::integral_constant< bool, P == BufferOverflow::Grow >;
+
+    void _noteSize() { _highWater = std::max( _highWater, size() ); }
+
+    // makes room for n more elements as the policy says, returns how many of
+    // them can be stored
+    int _room( int n ) {
+        assert( P == BufferOverflow::Grow || capacity() > 0 );
+        const int over = size() + n - capacity();
+        if ( over <= 0 )
+            return n;
+        if ( P == BufferOverflow::Grow ) {
+            _grow( size() + n, CanGrow() );
+            return n;
+        }
+        _dropped += over;
+        if ( P == BufferOverflow::Reject )
+            return n - over;
+        if ( n >= capacity() ) {
+            clear();
+            return capacity();
+        }
+        for ( int i = 0; i < over; ++i )
+            pop_front();
+        return n;
+    }
 
-    int _nxt( int x, int ix = 1 ) const {
-        // this is weird, but we need to make sure result is positive even if
-        // x + ix < 0
-        return (((x + ix) % _size) + _size) % _size;
+    void _grow( int, std::false_type ) { }
+
+    void _grow( int need, std::true_type ) {
+        int cap = std::max( capacity(), 1 );
+        while ( cap < need )
+            cap *= 2;
+        Slots bigger( cap );
+        unsigned pos = 0;
+        for ( T &x : *this ) {
+            new ( bigger.data() + pos++ ) T( std::move( x ) );
+            x.~T();
+        }
+        _slots.swap( bigger );
+        _read = 0;
+        _write = pos;
     }
 
-    template< typename Push >
-    void _push_back( Push push ) {
-        auto nwrite = _nxt( _write );
-        if ( nwrite == _read )
-            pop_front();
-        push( _data.get() + _write );
-        _write = nwrite;
+    void *_slot( unsigned pos ) { return _slots.data() + ( pos & _slots.mask() ); }
+    T &_at( unsigned pos ) { return *reinterpret_cast< T * >( _slot( pos ) ); }
+    const T &_at( unsigned pos ) const {
+        return *reinterpret_cast< const T * >( _slots.data() + ( pos & _slots.mask() ) );
+    }
+
+    void _append( const Buffer &o ) {
+        const auto spans = o.as_spans();
+        push_range( spans.first.begin(), spans.first.end() );
+        push_range( spans.second.begin(), spans.second.end() );
+    }
+
+    template< typename It >
+    void _push_range( It first, It last, std::false_type ) {
+        for ( ; first != last; ++first )
+            push_back( *first );
+    }
+
+    // at most capacity() elements are copied, in at most two runs
+    template< typename Ptr >
+    void _push_range( Ptr first, Ptr last, std::true_type ) {
+        const int n = last - first;
+        const int fit = _room( n );
+        if ( P == BufferOverflow::Overwrite )
+            first += n - fit; // the last ones
+        const unsigned at = _write & _slots.mask();
+        const int run = std::min( fit, int( _slots.mask() + 1 - at ) );
+        std::memcpy( _slot( _write ), first, run * sizeof( T ) );
+        std::memcpy( _slot( 0 ), first + run, ( fit - run ) * sizeof( T ) );
+        _write += fit;
+        _noteSize();
+    }
+
+    void _take( Buffer &o, std::false_type ) {
+        std::swap( _read, o._read );
+        std::swap( _write, o._write );
+    }
+
+    void _take( Buffer &o, std::true_type ) {
+        for ( T &x : o )
+            new ( _slot( _write++ ) ) T( std::move( x ) );
+        o.clear();
+    }
+
+    void _swap( Buffer &o, std::false_type ) {
+        _slots.swap( o._slots );
+        std::swap( _read, o._read );
+        std::swap( _write, o._write );
+    }
+
+    void _swap( Buffer &o, std::true_type ) {
+        Buffer tmp( std::move( o ) );
+        o._take( *this, std::true_type() );
+        _take( tmp, std::true_type() );
+    }
+
+    template< typename V >
+    bool _push_back( V &&val ) {
+        if ( P == BufferOverflow::Overwrite && size() == capacity() ) {
+            assert( capacity() > 0 );
+            ++_dropped;
+            _recycle() = std::forward< V >( val );
+            ++_write; // the high water is at capacity already
+            return true;
+        }
+        if ( !_room( 1 ) )
+            return false;
+        new ( _slot( _write ) ) T( std::forward< V >( val ) );
+        ++_write;
+        _noteSize();
+        return true;
+    }
+
+    template< typename V, typename Self >
+    static std::pair< Span< V >, Span< V > > _spans( Self *self ) {
+        const int len = self->size();
+        const unsigned mask = self->_slots.mask();
+        const int first = std::min( len, int( mask + 1 - ( self->_read & mask ) ) );
+        return { { &self->_at( self->_read ), first },
+                 { &self->_at( 0 ), len - first } };
+    }
+
+    // drops the oldest element, moving it to the write slot to be assigned
+    // over (a move keeps its resources, e.g. the buffer of a vector)
+    T &_recycle() {
+        T &oldest = _at( _read++ );
+        if ( _slot( _write ) == &oldest )
+            return oldest;
+        T *slot = new ( _slot( _write ) ) T( std::move( oldest ) );
+        oldest.~T();
+        return *slot;
+    }
+};
+
+// Ring of at most size elements for exactly one producer and one consumer
+// thread, pushing into a full buffer drops the oldest element as in Buffer.
+// Elements are read in place rather than copied out; the slots are default
+// constructed once and assigned over, so e.g. vectors keep their capacity.
+//
+// The producer drops the oldest element by advancing the read counter, which
+// the consumer also advances to claim the element it reads, so the counter is
+// changed with compare and swap. There is a spare slot, so that the producer
+// cannot reach the claimed element until it has pushed size more elements;
+// if it laps the consumer like that, push_back fails rather than overwrite
+// the element being read. With the Reject policy a full buffer fails the push
+// instead and the producer never touches the read counter.
+template< typename T, BufferOverflow P = BufferOverflow::Overwrite >
+struct SpscBuffer {
+    static_assert( P != BufferOverflow::Grow, "SpscBuffer can't grow" );
+
+    using value_type = T;
+
+    SpscBuffer( int size ) :
+        _size( size ), _mask( bufferStorage( size + 1 ) - 1 ),
+        _data( new T[ _mask + 1 ] )
+    { }
+
+    // producer only, fails if the consumer still reads the slot or, with the
+    // Reject policy, if the buffer is full
+    bool push_back( const T &val ) { return _push_back( val ); }
+    bool push_back( T &&val ) { return _push_back( std::move( val ) ); }
+
+    // consumer only, calls f with the oldest element (of type T &) and removes
+    // it, returns false if the buffer is empty
+    template< typename F >
+    bool consume( F f ) {
+        auto r = _read.load( std::memory_order_acquire );
+        do {
+            if ( r == _write.load( std::memory_order_acquire ) )
+                return false;
+            _busy.store( ( r & _mask ) + 1, std::memory_order_relaxed );
+        } while ( !_read.compare_exchange_weak( r, r + 1, std::memory_order_acq_rel,
+                                                std::memory_order_acquire ) );
+        f( _data[ r & _mask ] );
+        _busy.store( 0, std::memory_order_release );
+        return true;
+    }
+
+    // consumer only, moves the oldest element out
+    bool pop_front( T &val ) {
+        return consume( [&]( T &x ) { val = std::move( x ); } );
+    }
+
+    // exact only in the thread which is not running
+    int size() const {
+        return _write.load( std::memory_order_acquire ) - _read.load( std::memory_order_acquire );
+    }
+    bool empty() const { return size() == 0; }
+    int capacity() const { return _size; }
+
+  private:
+    const int _size;      // capacity
+    const unsigned _mask; // storage size - 1, there is a slot more than _size
+    std::unique_ptr< T[] > _data;
+    std::atomic< unsigned > _read{ 0 };  // free-running, as in Buffer
+    std::atomic< unsigned > _write{ 0 }; // written by the producer only
+    std::atomic< unsigned > _busy{ 0 };  // slot read by the consumer + 1, or 0
+
+    template< typename V >
+    bool _push_back( V &&val ) {
+        assert( _size > 0 );
+        const auto w = _write.load( std::memory_order_relaxed );
+        auto r = _read.load( std::memory_order_acquire );
+        if ( P == BufferOverflow::Reject && int( w - r ) >= _size )
+            return false;
+        // drop the oldest one unless the consumer takes it meanwhile
+        while ( int( w - r ) >= _size ) {
+            if ( _read.compare_exchange_weak( r, r + 1, std::memory_order_acq_rel,
+                                              std::memory_order_acquire ) )
+                break;
+        }
+        if ( _busy.load( std::memory_order_acquire ) == ( w & _mask ) + 1 )
+            return false;
+        _data[ w & _mask ] = std::forward< V >( val );
+        _write.store( w + 1, std::memory_order_release );
+        return true;
     }
 };
 
 namespace std {
 
-template< typename T >
-void swap( Buffer< T > &a, Buffer< T > &b ) {
+template< typename T, int N, BufferOverflow P >
+void swap( Buffer< T, N, P > &a, Buffer< T, N, P > &b ) {
     a.swap( b );
 }
 
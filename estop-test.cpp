@@ -0,0 +1,64 @@
+#include "ev3dev.h"
+#include "fakesysfs.h"
+#include <dirent.h>
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <atomic>
+#undef NDEBUG // the checks run in release builds (MODE=Release) too
+#include <cassert>
+
+// built with SYS_ROOT pointing to a fake sysfs tree which is created here
+
+int openFiles() {
+    int n = 0;
+    DIR *d = opendir( "/proc/self/fd" );
+    while ( readdir( d ) )
+        ++n;
+    closedir( d );
+    return n;
+}
+
+int main() {
+    FakeSysfs sys( SYS_ROOT );
+    sys.brick();
+    sys.put( sys.motorDir( 2 ) + "command", "run-forever" ); // a newer driver
+    const unsigned armed = ev3dev::estop::arm();
+    assert( armed == 3 );
+
+    long worst = 0;
+    for ( int round = 0; round < 1000; ++round ) {
+        for ( int i = 0; i < 3; ++i )
+            sys.put( sys.motorDir( i ) + "run", "1" );
+
+        auto start = std::chrono::steady_clock::now();
+        ev3dev::estop::trigger();
+        long ns = std::chrono::duration_cast< std::chrono::nanoseconds >(
+                        std::chrono::steady_clock::now() - start ).count();
+        worst = std::max( worst, ns );
+
+        for ( int i = 0; i < 3; ++i )
+            assert( sys.get( sys.motorDir( i ) + "run" ) == "0" );
+    }
+    assert( sys.get( sys.motorDir( 2 ) + "command" ).substr( 0, 4 ) == "stop" );
+
+    // reported only, timing on a shared host says nothing about the brick
+    std::cout << "estop worst-case latency: " << worst / 1000 << " us" << std::endl;
+
+    // re-arming while another thread triggers closes only unused descriptors
+    const int files = openFiles();
+    std::atomic< bool > stop{ false };
+    std::thread trigger( [&] {
+            while ( !stop )
+                ev3dev::estop::trigger();
+        } );
+    for ( int i = 0; i < 200; ++i ) {
+        const unsigned rearmed = ev3dev::estop::arm();
+        assert( rearmed == 3 );
+    }
+    stop = true;
+    trigger.join();
+    assert( openFiles() == files );
+    return 0;
+}
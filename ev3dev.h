@@ -34,8 +34,19 @@
 
 #include <map>
 #include <set>
+#include <bitset>
+#include <algorithm>
+#include <iosfwd>
 #include <string>
+#include <system_error>
+#include <vector>
+#include <utility>
 #include <functional>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <deque>
 
 //-----------------------------------------------------------------------------
 
@@ -45,12 +56,118 @@ namespace ev3dev {
 
 typedef std::string         device_type;
 typedef std::string         port_type;
-typedef std::string         mode_type;
-typedef std::set<mode_type> mode_set;
 typedef std::string         address_type;
 
 //-----------------------------------------------------------------------------
 
+// Interned name of a mode (also used for commands, states and triggers).
+// Each distinct name gets a small id when first seen and is kept for the
+// lifetime of the process, so copying and comparing modes and converting
+// them back to text never allocates. The table grows in chunks as names
+// show up, up to max_modes which is all the ids there are.
+class mode_type
+{
+public:
+  static constexpr unsigned max_modes = 65536;
+
+  mode_type() = default;
+  mode_type(const char *name);
+  mode_type(const std::string &name) : mode_type(name.data(), name.size()) {}
+  mode_type(const char *name, size_t length);
+
+  inline unsigned id()    const { return _id; }
+  inline bool     empty() const { return _id == 0; }
+
+  const std::string &str() const;
+  inline const char *c_str() const { return str().c_str(); }
+  inline operator const std::string &() const { return str(); }
+
+  friend inline bool operator==(mode_type a, mode_type b) { return a._id == b._id; }
+  friend inline bool operator!=(mode_type a, mode_type b) { return a._id != b._id; }
+
+private:
+  friend class mode_set;
+
+  unsigned short _id = 0; // 0 is the empty name
+};
+
+std::ostream &operator<<(std::ostream &os, mode_type m);
+
+//-----------------------------------------------------------------------------
+
+// Set of modes as a bitmask over their ids. Ids past the bitmask (names
+// interned after the first bitmask_modes) are kept in a sorted vector.
+// Iterates in the order the names were interned.
+class mode_set
+{
+public:
+  static constexpr unsigned bitmask_modes = 256;
+
+  class const_iterator
+  {
+  public:
+    const_iterator(const mode_set *s, unsigned id) : _set(s), _id(id) { skip(); }
+
+    mode_type operator*() const { mode_type m; m._id = _id; return m; }
+    const_iterator &operator++() { ++_id; skip(); return *this; }
+    bool operator==(const const_iterator &o) const { return _id == o._id; }
+    bool operator!=(const const_iterator &o) const { return _id != o._id; }
+
+  private:
+    void skip()
+    {
+      while ((_id < bitmask_modes) && !_set->_bits[_id])
+        ++_id;
+      if ((_id >= bitmask_modes) && (_id < mode_type::max_modes))
+      {
+        auto it = std::lower_bound(_set->_more.begin(), _set->_more.end(), _id);
+        _id = (it == _set->_more.end()) ? mode_type::max_modes : *it;
+      }
+    }
+
+    const mode_set *_set;
+    unsigned        _id;
+  };
+
+  bool insert(mode_type m)
+  {
+    if (m._id < bitmask_modes)
+    {
+      bool fresh = !_bits[m._id];
+      _bits.set(m._id);
+      return fresh;
+    }
+
+    auto it = std::lower_bound(_more.begin(), _more.end(), m._id);
+    if ((it != _more.end()) && (*it == m._id))
+      return false;
+    _more.insert(it, m._id);
+    return true;
+  }
+
+  size_t count(mode_type m) const
+  {
+    if (m._id < bitmask_modes)
+      return _bits[m._id];
+    return std::binary_search(_more.begin(), _more.end(), m._id);
+  }
+
+  size_t size()  const { return _bits.count() + _more.size(); }
+  bool   empty() const { return _bits.none() && _more.empty(); }
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end()   const { return const_iterator(this, mode_type::max_modes); }
+
+  bool operator==(const mode_set &o) const { return (_bits == o._bits) && (_more == o._more); }
+  bool operator!=(const mode_set &o) const { return !(*this == o); }
+
+private:
+  std::bitset<bitmask_modes>  _bits;
+  std::vector<unsigned short> _more;
+};
+
+//-----------------------------------------------------------------------------
+
 const port_type INPUT_AUTO;          //!< Automatic input selection
 const port_type INPUT_1  { "in1" };  //!< Sensor port 1
 const port_type INPUT_2  { "in2" };  //!< Sensor port 2
@@ -65,6 +182,140 @@ const port_type OUTPUT_D { "outD" }; //!< Motor port D
 
 //-----------------------------------------------------------------------------
 
+// A sysfs attribute file kept open for repeated pread/pwrite access, so that
+// reading or writing a value costs exactly one syscall. Copies dup() the
+// descriptor.
+class attr_file
+{
+public:
+  attr_file() {}
+  explicit attr_file(const std::string &path) noexcept;
+  attr_file(const attr_file &) noexcept;
+  attr_file(attr_file &&o) noexcept : _fd(o._fd) { o._fd = -1; }
+  ~attr_file();
+
+  attr_file &operator=(attr_file o) noexcept { std::swap(_fd, o._fd); return *this; }
+
+  inline bool is_open() const { return _fd >= 0; }
+  inline int  fd() const { return _fd; }
+
+  // both return false and leave errno set on failure
+  bool read_int (int &value) const noexcept;
+  bool write_int(int value) const noexcept;
+
+  // returns number of bytes read or -1
+  int  read (char *buf, unsigned size) const noexcept;
+  bool write(const char *buf, unsigned size) const noexcept;
+
+protected:
+  int _fd = -1;
+};
+
+//-----------------------------------------------------------------------------
+
+// Handle to a single attribute of a device, resolved (and in the default
+// backend opened) once, so reading or writing it involves no string work.
+// Obtain one from device::attr<T>(name); T is int or std::string.
+template <typename T>
+class attribute
+{
+public:
+  attribute() {}
+  explicit attribute(const std::string &path);
+
+  bool is_open() const;
+
+  T    get() const;
+  void set(const T &value) const;
+
+  // as get() and set(), reporting failures (including exceptions such as
+  // running out of memory) as an error code instead of throwing
+  std::error_code try_get(T &value) const noexcept;
+  std::error_code try_set(const T &value) const noexcept;
+
+protected:
+  friend class io_batch;
+
+  std::string _path; // for error messages, and the file in the fstream backend
+#ifndef EV3DEV_FSTREAM_IO
+  attr_file _file;
+#endif
+};
+
+extern template class attribute<int>;
+extern template class attribute<std::string>;
+
+//-----------------------------------------------------------------------------
+
+// Collects the attribute reads and writes of one control-loop tick and
+// performs them together on submit(): as one pread/pwrite per operation, or
+// as a single io_uring batch in builds that opt in and where the kernel
+// supports it. Buffers
+// and result variables passed in must stay valid until submit() returns.
+class io_batch
+{
+public:
+  explicit io_batch(unsigned depth = 16);
+  ~io_batch();
+
+  io_batch(const io_batch &) = delete;
+  io_batch &operator=(const io_batch &) = delete;
+
+  inline bool uses_uring() const { return _ring != nullptr; }
+
+  void read (const attribute<int> &a, int &result);
+  void write(const attribute<int> &a, int value);
+  void read (const attr_file &f, char *buf, unsigned size, int &len);
+
+  // as write(), and calls done(ctx, value) once the write has succeeded
+  void write(const attribute<int> &a, int value,
+             void (*done)(void *ctx, int value), void *ctx);
+
+  // performs all queued operations, returns false if any of them failed
+  // (results of the failed ones are left untouched) with errno set by the
+  // last failure, EIO for a short write
+  bool submit();
+
+  struct stats
+  {
+    unsigned long ticks    = 0;
+    unsigned long ops      = 0;
+    unsigned long syscalls = 0;
+    unsigned long total_ns = 0;
+    unsigned long max_ns   = 0;
+  };
+
+  const stats &statistics() const { return _stats; }
+
+protected:
+  struct op
+  {
+    int      fd;
+    bool     write;
+    char    *buf;     // nullptr means tmp
+    unsigned size;
+    int     *len;
+    int     *value;
+    int      res;
+    char     tmp[16];
+    void   (*done)(void *, int) = nullptr; // completion hook of a write
+    void    *ctx   = nullptr;
+    int      arg   = 0;
+    bool     complete = false; // res is final
+  };
+
+  struct ring;
+
+  bool submit_uring();
+  void submit_sync();
+
+  std::vector<op> _ops;
+  ring           *_ring = nullptr;
+  stats           _stats;
+};
+
+//-----------------------------------------------------------------------------
+
 class device
 {
 public:
@@ -72,7 +323,7 @@ public:
                const std::string &pattern,
                const std::map<std::string,
                               std::set<std::string>> &match) noexcept;
-  inline bool connected() const { return !_path.empty(); }
+  inline bool connected() const { resolve(); return !_path.empty(); }
 
   int         device_index() const;
 
@@ -85,13 +336,61 @@ public:
 
   std::string get_attr_line  (const std::string &name) const;
   mode_set    get_attr_set   (const std::string &name,
-                              std::string *pCur = nullptr) const;
-
-  std::string get_attr_from_set(const std::string &name) const;
+                              mode_type *pCur = nullptr) const;
+
+  // first word of the attribute, and the [selected] entry of a list
+  mode_type   get_attr_mode    (const std::string &name) const;
+  mode_type   get_attr_from_set(const std::string &name) const;
+
+  // Variants of the accessors above for control loops, which return the
+  // error (also for a device that is not connected, or not_enough_memory when
+  // building the path or caching the handle runs out of memory) instead of
+  // throwing.
+  std::error_code try_get_int   (const std::string &name, int &value) const noexcept;
+  std::error_code try_set_int   (const std::string &name, int value) noexcept;
+  std::error_code try_get_string(const std::string &name, std::string &value) const noexcept;
+  std::error_code try_set_string(const std::string &name, const std::string &value) noexcept;
+  std::error_code try_get_mode  (const std::string &name, mode_type &value) const noexcept;
+
+  // resolves attribute name of the connected device, the handle is not
+  // open if the device is not connected or has no such attribute
+  template <typename T>
+  attribute<T> attr(const std::string &name) const
+  {
+    resolve();
+    return _path.empty() ? attribute<T>() : attribute<T>(_path + name);
+  }
 
 protected:
+  // reads the first line of the attribute into buf (at most size - 1
+  // characters, zero terminated) and returns its length
+  unsigned read_line(const std::string &name, char *buf, unsigned size) const;
+  std::error_code try_read_line(const std::string &name, char *buf,
+                                unsigned size, unsigned &length) const noexcept;
+
+  // Postpones connect(dir, pattern) to the first use of the device, so the
+  // static leds and battery cost nothing in programs which never touch them.
+  // Like the rest of the device state this is not locked.
+  void connect_on_use(const std::string &dir, const std::string &pattern);
+
+  inline void resolve() const { if (!_deferred_dir.empty()) connect_deferred(); }
+  void connect_deferred() const;
+
   std::string _path;
   mutable int _device_index = -1;
+
+  mutable std::string _deferred_dir;
+  mutable std::string _deferred_pattern;
+
+#ifndef EV3DEV_FSTREAM_IO
+  // Attribute files opened so far by the get/set_attr_* family. Kept per
+  // device (not in a global cache) so no lock is needed on access; a device
+  // must therefore not be used from several threads at once.
+  const attr_file &file(const std::string &name) const;
+  std::error_code open_file(const std::string &name, const attr_file *&result) const noexcept;
+
+  mutable std::vector<std::pair<std::string, attr_file>> _files;
+#endif
 };
 
 //-----------------------------------------------------------------------------
@@ -119,29 +418,94 @@ public:
   using device::connected;
   using device::device_index;
 
+  using device::attr;
+  using device::try_get_int;
+  using device::try_set_int;
+
   int   value(unsigned index=0) const;
   float float_value(unsigned index=0) const;
+
+  // value() without exceptions, a bad sample can be dropped cheaply
+  std::error_code try_value(unsigned index, int &value) const noexcept;
   std::string type_name() const;
 
+  static constexpr unsigned max_values = 8;
+
+  // Reads all values of the current mode with a single read of bin_data,
+  // decoded according to bin_data_format. Stores at most size values into
+  // buf and returns the number of values stored.
+  unsigned values(int *buf, unsigned size = max_values) const;
+
+  // Raw contents of bin_data, returns the number of bytes read.
+  unsigned read_bin_data(char *buf, unsigned size) const;
+
+  // One sample read through an io_batch: queue_sample() queues the read of
+  // bin_data, decode() turns it into values (like values()) after submit.
+  // decode() stores fewer values (down to 0) instead of throwing on errors.
+  struct sample
+  {
+    char data[max_values * 4];
+    int  len = -1;
+  };
+
+  // without bin_data nothing is queued and decode() reads the values
+  void queue_sample(io_batch &io, sample &s) const
+  {
+    if (_bin_data.is_open())
+      io.read(_bin_data, s.data, sizeof(s.data), s.len);
+  }
+  unsigned decode(const sample &s, int *buf, unsigned size = max_values) const noexcept;
+
+  enum class bin_format { none, u8, s8, u16, s16, s16_be, s32, float32 };
+
+  // Metadata of a mode, read once when the mode is first selected by
+  // set_mode (or on the first sample). value() and float_value() are checked
+  // and scaled against it instead of re-reading the attributes.
+  struct mode_info
+  {
+    unsigned    num_values = 0;
+    int         decimals   = 0;
+    float       scale      = 1;  // 10^-decimals
+    std::string units;
+    bin_format  format     = bin_format::none;
+  };
+
+  const mode_info &current_mode() const;
+
   //~autogen cpp_generic-get-set classes.sensor>currentClass
 
-    int decimals() const { return get_attr_int("decimals"); }
-    std::string mode() const { return get_attr_string("mode"); }
-    void set_mode(std::string v) { set_attr_string("mode", v); }
+    int decimals() const { return _decimals.get(); }
+    mode_type mode() const { return get_attr_mode("mode"); }
+    void set_mode(mode_type v) { set_attr_string("mode", v); select_mode(v); }
     mode_set modes() const { return get_attr_set("modes"); }
-    void set_command(std::string v) { set_attr_string("command", v); }
+    void set_command(mode_type v) { set_attr_string("command", v); }
     mode_set commands() const { return get_attr_set("commands"); }
-    int num_values() const { return get_attr_int("num_values"); }
+    int num_values() const { return _num_values.get(); }
     std::string port_name() const { return get_attr_string("port_name"); }
     std::string units() const { return get_attr_string("units"); }
     std::string driver_name() const { return get_attr_string("driver_name"); }
 
 //~autogen
 
+  // not in the spec the accessors above are generated from
+  std::string bin_data_format() const { return get_attr_string("bin_data_format"); }
+
 protected:
   sensor() {}
 
   bool connect(const std::map<std::string, std::set<std::string>>&) noexcept;
+
+  void select_mode(mode_type mode) const;
+  std::error_code try_select_mode(mode_type mode) const noexcept;
+  std::error_code try_current_mode(const mode_info *&result) const noexcept;
+
+  attribute<int> _decimals;
+  attribute<int> _num_values;
+  attribute<int> _values[max_values];
+  attr_file      _bin_data;
+
+  mutable std::vector<std::pair<mode_type, mode_info>> _mode_cache;
+  mutable int _mode = -1;
 };
 
 //-----------------------------------------------------------------------------
@@ -249,71 +613,219 @@ public:
 
   using device::connected;
   using device::device_index;
+  using device::attr;
+  using device::try_get_int;
+  using device::try_set_int;
 
   //~autogen cpp_generic-get-set classes.motor>currentClass
 
     int duty_cycle() const { return get_attr_int("duty_cycle"); }
-    int duty_cycle_sp() const { return get_attr_int("duty_cycle_sp"); }
-    void set_duty_cycle_sp(int v) { set_attr_int("duty_cycle_sp", v); }
-    std::string encoder_mode() const { return get_attr_string("encoder_mode"); }
-    void set_encoder_mode(std::string v) { set_attr_string("encoder_mode", v); }
+    int duty_cycle_sp() const { return _sp.duty_cycle_sp.known ? _sp.duty_cycle_sp.value : get_attr_int("duty_cycle_sp"); }
+    void set_duty_cycle_sp(int v) { write_through(_sp.duty_cycle_sp, v, [&] { set_attr_int("duty_cycle_sp", v); }); }
+    mode_type encoder_mode() const { return _sp.encoder_mode.known ? _sp.encoder_mode.value : get_attr_mode("encoder_mode"); }
+    void set_encoder_mode(mode_type v) { write_through(_sp.encoder_mode, v, [&] { set_attr_string("encoder_mode", v); }); }
     mode_set encoder_modes() const { return get_attr_set("encoder_modes"); }
     std::string emergency_stop() const { return get_attr_string("estop"); }
     void set_emergency_stop(std::string v) { set_attr_string("estop", v); }
     std::string debug_log() const { return get_attr_string("log"); }
-    std::string polarity_mode() const { return get_attr_string("polarity_mode"); }
-    void set_polarity_mode(std::string v) { set_attr_string("polarity_mode", v); }
+    mode_type polarity_mode() const { return _sp.polarity_mode.known ? _sp.polarity_mode.value : get_attr_mode("polarity_mode"); }
+    void set_polarity_mode(mode_type v) { write_through(_sp.polarity_mode, v, [&] { set_attr_string("polarity_mode", v); }); }
     mode_set polarity_modes() const { return get_attr_set("polarity_modes"); }
     std::string port_name() const { return get_attr_string("port_name"); }
-    int position() const { return get_attr_int("position"); }
-    void set_position(int v) { set_attr_int("position", v); }
-    std::string position_mode() const { return get_attr_string("position_mode"); }
-    void set_position_mode(std::string v) { set_attr_string("position_mode", v); }
+    int position() const { return _position.get(); }
+    void set_position(int v) { _position.set(v); }
+    mode_type position_mode() const { return _sp.position_mode.known ? _sp.position_mode.value : get_attr_mode("position_mode"); }
+    void set_position_mode(mode_type v) { write_through(_sp.position_mode, v, [&] { set_attr_string("position_mode", v); }); }
     mode_set position_modes() const { return get_attr_set("position_modes"); }
-    int position_sp() const { return get_attr_int("position_sp"); }
-    void set_position_sp(int v) { set_attr_int("position_sp", v); }
-    int pulses_per_second() const { return get_attr_int("pulses_per_second"); }
-    int pulses_per_second_sp() const { return get_attr_int("pulses_per_second_sp"); }
-    void set_pulses_per_second_sp(int v) { set_attr_int("pulses_per_second_sp", v); }
-    int ramp_down_sp() const { return get_attr_int("ramp_down_sp"); }
-    void set_ramp_down_sp(int v) { set_attr_int("ramp_down_sp", v); }
-    int ramp_up_sp() const { return get_attr_int("ramp_up_sp"); }
-    void set_ramp_up_sp(int v) { set_attr_int("ramp_up_sp", v); }
-    std::string regulation_mode() const { return get_attr_string("regulation_mode"); }
-    void set_regulation_mode(std::string v) { set_attr_string("regulation_mode", v); }
+    int position_sp() const { return _sp.position_sp.known ? _sp.position_sp.value : _position_sp.get(); }
+    void set_position_sp(int v) { write_through(_sp.position_sp, v, [&] { _position_sp.set(v); }); }
+    int pulses_per_second() const { return _pulses_per_second.get(); }
+    int pulses_per_second_sp() const { return _sp.pulses_per_second_sp.known ? _sp.pulses_per_second_sp.value : _pulses_per_second_sp.get(); }
+    void set_pulses_per_second_sp(int v) { write_through(_sp.pulses_per_second_sp, v, [&] { _pulses_per_second_sp.set(v); }); }
+    int ramp_down_sp() const { return _sp.ramp_down_sp.known ? _sp.ramp_down_sp.value : get_attr_int("ramp_down_sp"); }
+    void set_ramp_down_sp(int v) { write_through(_sp.ramp_down_sp, v, [&] { set_attr_int("ramp_down_sp", v); }); }
+    int ramp_up_sp() const { return _sp.ramp_up_sp.known ? _sp.ramp_up_sp.value : get_attr_int("ramp_up_sp"); }
+    void set_ramp_up_sp(int v) { write_through(_sp.ramp_up_sp, v, [&] { set_attr_int("ramp_up_sp", v); }); }
+    mode_type regulation_mode() const { return _sp.regulation_mode.known ? _sp.regulation_mode.value : get_attr_mode("regulation_mode"); }
+    void set_regulation_mode(mode_type v) { write_through(_sp.regulation_mode, v, [&] { set_attr_string("regulation_mode", v); }); }
     mode_set regulation_modes() const { return get_attr_set("regulation_modes"); }
-    int run() const { return get_attr_int("run"); }
-    void set_run(int v) { set_attr_int("run", v); }
-    std::string run_mode() const { return get_attr_string("run_mode"); }
-    void set_run_mode(std::string v) { set_attr_string("run_mode", v); }
+    int run() const { return _run.get(); }
+    void set_run(int v) { _run.set(v); }
+    mode_type run_mode() const { return _sp.run_mode.known ? _sp.run_mode.value : get_attr_mode("run_mode"); }
+    void set_run_mode(mode_type v) { write_through(_sp.run_mode, v, [&] { set_attr_string("run_mode", v); }); }
     mode_set run_modes() const { return get_attr_set("run_modes"); }
-    int speed_regulation_p() const { return get_attr_int("speed_regulation_P"); }
-    void set_speed_regulation_p(int v) { set_attr_int("speed_regulation_P", v); }
-    int speed_regulation_i() const { return get_attr_int("speed_regulation_I"); }
-    void set_speed_regulation_i(int v) { set_attr_int("speed_regulation_I", v); }
-    int speed_regulation_d() const { return get_attr_int("speed_regulation_D"); }
-    void set_speed_regulation_d(int v) { set_attr_int("speed_regulation_D", v); }
-    int speed_regulation_k() const { return get_attr_int("speed_regulation_K"); }
-    void set_speed_regulation_k(int v) { set_attr_int("speed_regulation_K", v); }
-    std::string state() const { return get_attr_string("state"); }
-    std::string stop_mode() const { return get_attr_string("stop_mode"); }
-    void set_stop_mode(std::string v) { set_attr_string("stop_mode", v); }
+    int speed_regulation_p() const { return _sp.speed_regulation_p.known ? _sp.speed_regulation_p.value : get_attr_int("speed_regulation_P"); }
+    void set_speed_regulation_p(int v) { write_through(_sp.speed_regulation_p, v, [&] { set_attr_int("speed_regulation_P", v); }); }
+    int speed_regulation_i() const { return _sp.speed_regulation_i.known ? _sp.speed_regulation_i.value : get_attr_int("speed_regulation_I"); }
+    void set_speed_regulation_i(int v) { write_through(_sp.speed_regulation_i, v, [&] { set_attr_int("speed_regulation_I", v); }); }
+    int speed_regulation_d() const { return _sp.speed_regulation_d.known ? _sp.speed_regulation_d.value : get_attr_int("speed_regulation_D"); }
+    void set_speed_regulation_d(int v) { write_through(_sp.speed_regulation_d, v, [&] { set_attr_int("speed_regulation_D", v); }); }
+    int speed_regulation_k() const { return _sp.speed_regulation_k.known ? _sp.speed_regulation_k.value : get_attr_int("speed_regulation_K"); }
+    void set_speed_regulation_k(int v) { write_through(_sp.speed_regulation_k, v, [&] { set_attr_int("speed_regulation_K", v); }); }
+    mode_type state() const { return get_attr_mode("state"); }
+    mode_type stop_mode() const { return _sp.stop_mode.known ? _sp.stop_mode.value : get_attr_mode("stop_mode"); }
+    void set_stop_mode(mode_type v) { write_through(_sp.stop_mode, v, [&] { set_attr_string("stop_mode", v); }); }
     mode_set stop_modes() const { return get_attr_set("stop_modes"); }
-    int time_sp() const { return get_attr_int("time_sp"); }
-    void set_time_sp(int v) { set_attr_int("time_sp", v); }
+    int time_sp() const { return _sp.time_sp.known ? _sp.time_sp.value : get_attr_int("time_sp"); }
+    void set_time_sp(int v) { write_through(_sp.time_sp, v, [&] { set_attr_int("time_sp", v); }); }
     std::string type() const { return get_attr_string("type"); }
 
 //~autogen
 
-  void start()         { set_attr_int("run", 1); }
-  void stop()          { set_attr_int("run", 0); }
+  void start()         { _run.set(1); }
+  void stop()          { _run.set(0); }
   bool running() const { return run(); }
-  void reset()         { set_attr_int("reset", 1);    }
+  void reset()         { set_attr_int("reset", 1); _sp = setpoints(); }
+
+  // start(), stop() and set_position_sp() for control loops, returning
+  // the error instead of throwing
+  std::error_code try_start() noexcept { return _run.try_set(1); }
+  std::error_code try_stop()  noexcept { return _run.try_set(0); }
+  std::error_code try_set_position_sp(int v) noexcept
+  {
+    std::error_code ec;
+    write_through(_sp.position_sp, v, [&] { ec = _position_sp.try_set(v); });
+    if (ec)
+      _sp.position_sp.known = false;
+    return ec;
+  }
+
+  // Forgets the shadowed setpoints so the next writes are issued again, for
+  // when a failed batch left the values in the driver unknown.
+  void forget_setpoints() noexcept { _sp = setpoints(); }
+
+  // Calls callback from a shared poller thread once the motor has stopped
+  // running. The poller sleeps in poll() on the state attribute: it wakes on
+  // POLLPRI where the driver notifies state changes and otherwise re-checks
+  // all watched motors at an adaptive period (a few ms, backing off while
+  // nothing finishes). The returned handle cancels the watch, e.g. when the
+  // motor is stopped or restarted for something else and would otherwise be
+  // polled until it happens to go idle.
+  typedef unsigned long idle_watch;
+  idle_watch on_idle(std::function<void()> callback) const;
+
+  // Drops a watch without calling its callback. A callback already running
+  // may still complete; finished watches and 0 are ignored.
+  static void cancel_idle(idle_watch watch);
+
+  // blocks until the motor has stopped running without spinning on sysfs
+  void wait_idle() const;
+
+  // Writes of setpoints are skipped when the value is unchanged since the
+  // last write, these count issued and skipped setpoint writes.
+  struct write_stats
+  {
+    unsigned long issued  = 0;
+    unsigned long skipped = 0;
+  };
+
+  const write_stats &setpoint_writes() const { return _writes; }
+
+  // batched variants of position(), run() and set_pulses_per_second_sp(),
+  // performed on io_batch::submit()
+  void queue_position(io_batch &io, int &result) const { io.read(_position, result); }
+  void queue_run(io_batch &io, int &result) const { io.read(_run, result); }
+  // the shadow only takes the value once submit() has written it
+  void queue_pulses_per_second_sp(io_batch &io, int v)
+  {
+    if (unchanged(_sp.pulses_per_second_sp, v))
+      return;
+
+    _sp.pulses_per_second_sp.known = false;
+    io.write(_pulses_per_second_sp, v, [](void *ctx, int value) {
+        auto &sp = *static_cast<shadow<int> *>(ctx);
+        sp.value = value;
+        sp.known = true;
+      }, &_sp.pulses_per_second_sp);
+  }
 
 protected:
   motor() {}
 
   bool connect(const std::map<std::string, std::set<std::string>>&) noexcept;
+
+  // attributes used in control loops, resolved on connect
+  attribute<int> _position;
+  attribute<int> _position_sp;
+  attribute<int> _pulses_per_second;
+  attribute<int> _pulses_per_second_sp;
+  attribute<int> _run;
+
+  // last value written to a setpoint, the driver only changes setpoints on
+  // reset so they can be answered from here as well
+  template <typename T>
+  struct shadow
+  {
+    bool known = false;
+    T    value = T();
+  };
+
+  struct setpoints
+  {
+    shadow<int> duty_cycle_sp;
+    shadow<mode_type> encoder_mode;
+    shadow<mode_type> polarity_mode;
+    shadow<mode_type> position_mode;
+    shadow<int> position_sp;
+    shadow<int> pulses_per_second_sp;
+    shadow<int> ramp_down_sp;
+    shadow<int> ramp_up_sp;
+    shadow<mode_type> regulation_mode;
+    shadow<mode_type> run_mode;
+    shadow<int> speed_regulation_p;
+    shadow<int> speed_regulation_i;
+    shadow<int> speed_regulation_d;
+    shadow<int> speed_regulation_k;
+    shadow<mode_type> stop_mode;
+    shadow<int> time_sp;
+  };
+
+  // counts the write as skipped if value is already in the driver, as
+  // issued otherwise
+  template <typename T>
+  bool unchanged(const shadow<T> &sp, const T &value)
+  {
+    if (sp.known && (sp.value == value))
+    {
+      ++_writes.skipped;
+      return true;
+    }
+
+    ++_writes.issued;
+    return false;
+  }
+
+  template <typename T, typename Write>
+  void write_through(shadow<T> &sp, const T &value, Write write)
+  {
+    if (unchanged(sp, value))
+      return;
+
+    write();
+    sp.value = value;
+    sp.known = true;
+  }
+
+  setpoints   _sp;
+  write_stats _writes;
+};
+
+//-----------------------------------------------------------------------------
+
+// Emergency stop of all tacho motors. arm() opens the run and command
+// attributes of every motor present, trigger() then stops them all with one
+// pwrite(2) per descriptor, taking no locks and allocating nothing, so it may
+// be called from a signal handler or any thread.
+class estop
+{
+public:
+  static constexpr unsigned max_files = 16;
+
+  // (re)opens the descriptors, returns the number of motors armed; when
+  // re-arming, the new set is swapped in and the old one is closed once no
+  // trigger() can still be using it
+  static unsigned arm();
+  static void trigger() noexcept;
 };
 
 //-----------------------------------------------------------------------------
@@ -339,18 +851,18 @@ class dc_motor : protected device
 public:
   dc_motor(port_type port_ = OUTPUT_AUTO);
 
-  static const std::string command_run;
-  static const std::string command_brake;
-  static const std::string command_coast;
-  static const std::string polarity_normal;
-  static const std::string polarity_inverted;
+  static const mode_type command_run;
+  static const mode_type command_brake;
+  static const mode_type command_coast;
+  static const mode_type polarity_normal;
+  static const mode_type polarity_inverted;
 
   using device::connected;
   using device::device_index;
 
   //~autogen cpp_generic-get-set classes.dcMotor>currentClass
 
-    void set_command(std::string v) { set_attr_string("command", v); }
+    void set_command(mode_type v) { set_attr_string("command", v); }
     mode_set commands() const { return get_attr_set("commands"); }
     int duty_cycle() const { return get_attr_int("duty_cycle"); }
     void set_duty_cycle(int v) { set_attr_int("duty_cycle", v); }
@@ -360,8 +872,8 @@ public:
     void set_ramp_down_ms(int v) { set_attr_int("ramp_down_ms", v); }
     int ramp_up_ms() const { return get_attr_int("ramp_up_ms"); }
     void set_ramp_up_ms(int v) { set_attr_int("ramp_up_ms", v); }
-    std::string polarity() const { return get_attr_string("polarity"); }
-    void set_polarity(std::string v) { set_attr_string("polarity", v); }
+    mode_type polarity() const { return get_attr_mode("polarity"); }
+    void set_polarity(mode_type v) { set_attr_string("polarity", v); }
 
 //~autogen
 
@@ -376,18 +888,18 @@ class servo_motor : protected device
 public:
   servo_motor(port_type port_ = OUTPUT_AUTO);
 
-  static const std::string command_run;
-  static const std::string command_float;
-  static const std::string polarity_normal;
-  static const std::string polarity_inverted;
+  static const mode_type command_run;
+  static const mode_type command_float;
+  static const mode_type polarity_normal;
+  static const mode_type polarity_inverted;
 
   using device::connected;
   using device::device_index;
 
   //~autogen cpp_generic-get-set classes.servoMotor>currentClass
 
-    std::string command() const { return get_attr_string("command"); }
-    void set_command(std::string v) { set_attr_string("command", v); }
+    mode_type command() const { return get_attr_mode("command"); }
+    void set_command(mode_type v) { set_attr_string("command", v); }
     std::string driver_name() const { return get_attr_string("driver_name"); }
     std::string port_name() const { return get_attr_string("port_name"); }
     int max_pulse_ms() const { return get_attr_int("max_pulse_ms"); }
@@ -396,8 +908,8 @@ public:
     void set_mid_pulse_ms(int v) { set_attr_int("mid_pulse_ms", v); }
     int min_pulse_ms() const { return get_attr_int("min_pulse_ms"); }
     void set_min_pulse_ms(int v) { set_attr_int("min_pulse_ms", v); }
-    std::string polarity() const { return get_attr_string("polarity"); }
-    void set_polarity(std::string v) { set_attr_string("polarity", v); }
+    mode_type polarity() const { return get_attr_mode("polarity"); }
+    void set_polarity(mode_type v) { set_attr_string("polarity", v); }
     int position() const { return get_attr_int("position"); }
     void set_position(int v) { set_attr_int("position", v); }
     int rate() const { return get_attr_int("rate"); }
@@ -420,8 +932,8 @@ public:
     int max_brightness() const { return get_attr_int("max_brightness"); }
     int brightness() const { return get_attr_int("brightness"); }
     void set_brightness(int v) { set_attr_int("brightness", v); }
-    std::string trigger() const { return get_attr_string("trigger"); }
-    void set_trigger(std::string v) { set_attr_string("trigger", v); }
+    mode_type trigger() const { return get_attr_from_set("trigger"); }
+    void set_trigger(mode_type v) { set_attr_string("trigger", v); }
 
 //~autogen
 
@@ -434,6 +946,7 @@ public:
   void set_on_delay (unsigned ms) { set_attr_int("delay_on",  ms); }
   void set_off_delay(unsigned ms) { set_attr_int("delay_off", ms); }
 
+  // connected on first use
   static led red_right;
   static led red_left;
   static led green_right;
@@ -447,6 +960,9 @@ public:
   static void all_off  ();
 
 protected:
+  struct on_use {};
+  led(std::string name, on_use);
+
   int _max_brightness = 0;
 };
 
@@ -473,19 +989,73 @@ public:
   float current_amps()       const { return current_now() / 1000000.f; }
   float voltage_volts()      const { return voltage_now() / 1000000.f; }
 
+  // connected on first use
   static power_supply battery;
+
+protected:
+  struct on_use {};
+  power_supply(std::string name, on_use);
 };
 
 //-----------------------------------------------------------------------------
 
-class button
+// Key events of the brick buttons read from the input event device. A reader
+// thread sleeps in poll() on the device and keeps the current key state, so
+// querying a key costs no syscall. Events are timestamped by the kernel
+// (CLOCK_MONOTONIC, i.e. comparable with std::chrono::steady_clock), passed
+// to registered handlers from the reader thread and queued for pop().
+class input_events
 {
 public:
-  button(int bit);
-  ~button()
+  struct event
   {
-    delete _buf;
-  }
+    int  code;     // KEY_*
+    bool pressed;
+    long time_us;  // when the kernel saw the key change
+  };
+
+  static input_events &instance();
+
+  bool available() const { return _fd >= 0; }
+  bool pressed(int code) const;
+
+  void on_key(std::function<void (const event &)> handler);
+
+  // oldest event not yet taken, returns false if there is none
+  bool pop(event &e);
+
+private:
+  input_events();
+  ~input_events();
+
+  void loop();
+
+  static constexpr unsigned max_queued = 64;
+  static constexpr unsigned state_words = 16; // covers KEY_CNT bits
+
+  int _fd   = -1;
+  int _wake = -1;
+
+  std::atomic<unsigned> _state[state_words];
+
+  typedef std::vector<std::function<void (const event &)>> handler_list;
+
+  // handlers are called without holding _lock, from the snapshot taken with
+  // the event; on_key replaces the list rather than changing it in place
+  std::mutex _lock;
+  std::shared_ptr<const handler_list> _handlers = std::make_shared<handler_list>();
+  std::deque<event> _queue;
+  std::thread _thread;
+};
+
+//-----------------------------------------------------------------------------
+
+// A brick button. All buttons share the descriptor and key state of
+// input_events, which is opened when a button is first queried.
+class button
+{
+public:
+  constexpr button(int bit) : _bit(bit) {}
 
   bool pressed() const;
 
@@ -498,11 +1068,6 @@ public:
 
 private:
   int _bit;
-  int _fd;
-  int _bits_per_long;
-  unsigned long *_buf;
-  unsigned long _buf_size;
-
 };
 
 //-----------------------------------------------------------------------------
@@ -0,0 +1,124 @@
+#include <sys/stat.h>
+#include <ftw.h>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <cstdint>
+
+#ifndef _FAKESYSFS_H
+#define _FAKESYSFS_H
+
+// Fake sysfs tree for tests and benchmarks of ev3dev built with SYS_ROOT
+// pointing to root. Devices are directories of regular files holding the
+// attributes the library reads; put the root on tmpfs (e.g. /dev/shm) to
+// measure the cost of the library rather than of the disk. The tree is
+// removed again when the FakeSysfs goes away.
+struct FakeSysfs {
+    FakeSysfs( const std::string &root ) : _root( root ) {
+        mkdir( _root.c_str(), 0755 );
+        mkdir( ( _root + "/class" ).c_str(), 0755 );
+        mkdir( ( _root + "/class/tacho-motor" ).c_str(), 0755 );
+        mkdir( ( _root + "/class/lego-sensor" ).c_str(), 0755 );
+    }
+
+    FakeSysfs( const FakeSysfs & ) = delete;
+    FakeSysfs &operator=( const FakeSysfs & ) = delete;
+
+    ~FakeSysfs() { remove( _root ); }
+
+    std::string motorDir( int index ) const {
+        return _root + "/class/tacho-motor/motor" + std::to_string( index ) + "/";
+    }
+
+    std::string sensorDir( int index ) const {
+        return _root + "/class/lego-sensor/sensor" + std::to_string( index ) + "/";
+    }
+
+    // a tacho motor with its attributes at their values after reset
+    void motor( int index, const std::string &port,
+                const std::string &driver = "lego-ev3-l-motor" )
+    {
+        const std::string dir = motorDir( index );
+        mkdir( dir.c_str(), 0755 );
+        put( dir + "port_name", port );
+        put( dir + "driver_name", driver );
+        put( dir + "type", driver == "lego-ev3-m-motor" ? "minitacho" : "tacho" );
+        for ( auto a : { "position", "position_sp", "pulses_per_second",
+                         "pulses_per_second_sp", "run", "duty_cycle",
+                         "duty_cycle_sp", "time_sp", "ramp_up_sp",
+                         "ramp_down_sp", "reset" } )
+            put( dir + a, "0" );
+        put( dir + "state", "idle" );
+        put( dir + "run_mode", "forever" );
+        put( dir + "run_modes", "forever time position" );
+        put( dir + "stop_mode", "coast" );
+        put( dir + "stop_modes", "coast brake hold" );
+        put( dir + "regulation_mode", "off" );
+        put( dir + "regulation_modes", "off on" );
+        put( dir + "position_mode", "absolute" );
+        put( dir + "position_modes", "absolute relative" );
+        put( dir + "polarity_mode", "normal" );
+        put( dir + "polarity_modes", "normal inverted" );
+    }
+
+    // a sensor in the given mode with num_values s16 values, readable both
+    // from value<N> and from bin_data
+    void sensor( int index, const std::string &port, const std::string &driver,
+                 const std::string &mode, const std::string &modes, int num_values )
+    {
+        const std::string dir = sensorDir( index );
+        mkdir( dir.c_str(), 0755 );
+        put( dir + "port_name", port );
+        put( dir + "driver_name", driver );
+        put( dir + "mode", mode );
+        put( dir + "modes", modes );
+        put( dir + "num_values", std::to_string( num_values ) );
+        put( dir + "decimals", "0" );
+        put( dir + "units", "pct" );
+        put( dir + "bin_data_format", "s16" );
+
+        std::string bin;
+        for ( int i = 0; i < 8; ++i ) {
+            const int16_t v = i < num_values ? 100 + i : 0;
+            put( dir + "value" + std::to_string( i ), std::to_string( v ) );
+            if ( i < num_values )
+                bin.append( reinterpret_cast< const char * >( &v ), sizeof( v ) );
+        }
+        std::ofstream( dir + "bin_data", std::ios::trunc | std::ios::binary ) << bin;
+    }
+
+    // the robot as wired for bot2: drives on outA and outD, the sensor arm on
+    // outB, the colour sensor in in1 and the kill switch in in4
+    void brick() {
+        motor( 0, "outA" );
+        motor( 1, "outB", "lego-ev3-m-motor" );
+        motor( 2, "outD" );
+        sensor( 0, "in1", "lego-ev3-uart-29", "RGB-RAW",
+                "COL-REFLECT COL-AMBIENT COL-COLOR REF-RAW RGB-RAW", 3 );
+        sensor( 1, "in4", "lego-ev3-touch", "TOUCH", "TOUCH", 1 );
+    }
+
+    // removes a device directory (or any tree), as if it was unplugged
+    static void remove( const std::string &path ) {
+        nftw( path.c_str(), []( const char *p, const struct stat *, int, FTW * ) {
+                return std::remove( p );
+            }, 16, FTW_DEPTH | FTW_PHYS );
+    }
+
+    static void put( const std::string &path, const std::string &val ) {
+        std::ofstream f( path, std::ios::trunc );
+        f << val << '\n';
+    }
+
+    static std::string get( const std::string &path ) {
+        std::ifstream f( path );
+        std::string val;
+        f >> val;
+        return val;
+    }
+
+  private:
+    std::string _root;
+};
+
+#endif // _FAKESYSFS_H
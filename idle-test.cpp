@@ -0,0 +1,46 @@
+#include "ev3dev.h"
+#include "fakesysfs.h"
+#include <atomic>
+#undef NDEBUG // the checks run in release builds (MODE=Release) too
+#include <cassert>
+
+// built with SYS_ROOT pointing to a fake sysfs tree which is created here;
+// motor idle watches, the fake motors stop when the test writes run
+
+using namespace ev3dev;
+
+int main() {
+    FakeSysfs::remove( SYS_ROOT ); // left by an earlier run that crashed
+    FakeSysfs sys( SYS_ROOT );
+    sys.brick();
+
+    large_motor m( OUTPUT_A );
+    const std::string run = sys.motorDir( 0 ) + "run";
+
+    // a watch fires once the motor stops
+    std::atomic< int > fired( 0 );
+    m.start();
+    m.on_idle( [&] { ++fired; } );
+    FakeSysfs::put( run, "0" );
+    m.wait_idle();
+    assert( fired == 1 );
+
+    // a cancelled watch never fires, even once the motor stops; watches fire
+    // in the order they were added, so it would have by the time wait_idle
+    // returns
+    std::atomic< bool > cancelled( false );
+    m.start();
+    motor::cancel_idle( m.on_idle( [&] { cancelled = true; } ) );
+    FakeSysfs::put( run, "0" );
+    m.wait_idle();
+    assert( !cancelled && fired == 1 );
+
+    // handles of finished watches and 0 are ignored
+    motor::cancel_idle( 0 );
+    const motor::idle_watch done = m.on_idle( [&] { ++fired; } );
+    m.wait_idle();
+    motor::cancel_idle( done );
+    assert( fired == 2 );
+
+    return 0;
+}
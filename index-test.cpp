@@ -0,0 +1,35 @@
+#include "ev3dev.h"
+#include "fakesysfs.h"
+#undef NDEBUG // the checks run in release builds (MODE=Release) too
+#include <cassert>
+
+// built with SYS_ROOT pointing to a fake sysfs tree which is created here;
+// devices plugged in and out after the discovery index has seen the tree
+
+using namespace ev3dev;
+
+int main() {
+    FakeSysfs::remove( SYS_ROOT ); // left by an earlier run that crashed
+    FakeSysfs sys( SYS_ROOT );
+    sys.brick();
+
+    assert( motor( OUTPUT_A ).connected() ); // the index is populated now
+    assert( !motor( OUTPUT_C ).connected() );
+    assert( !sensor( INPUT_2 ).connected() );
+
+    sys.motor( 3, "outC" );
+    sys.sensor( 2, "in2", "lego-ev3-uart-29", "COL-REFLECT", "COL-REFLECT", 1 );
+    assert( motor( OUTPUT_C ).connected() );
+    sensor plugged( INPUT_2 );
+    assert( plugged.connected() && plugged.value( 0 ) == 100 );
+
+    FakeSysfs::remove( sys.sensorDir( 2 ) );
+    assert( !sensor( INPUT_2 ).connected() );
+
+    // plugged into another port under the same name
+    sys.sensor( 2, "in3", "lego-ev3-touch", "TOUCH", "TOUCH", 1 );
+    assert( !sensor( INPUT_2 ).connected() );
+    assert( sensor( INPUT_3 ).connected() );
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include "ev3dev.h"
+#include "fakesysfs.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <cassert>
+
+// Microbenchmarks of the ev3dev attribute I/O against a fake sysfs tree.
+// Built with SYS_ROOT pointing to the tree (created here, on tmpfs by default)
+// and run on a development machine, so that I/O changes can be compared
+// before they reach the brick. Prints one CSV line per benchmark:
+//     benchmark,backend,ns_per_op,ops
+
+using namespace ev3dev;
+
+// exposes the generic accessors which motor keeps protected
+struct Probe : motor {
+    Probe() : motor( OUTPUT_A ) { }
+    using motor::get_attr_int;
+    using motor::set_attr_int;
+};
+
+const char *backend() {
+#if defined( EV3DEV_FSTREAM_IO )
+    return "fstream";
+#else
+    io_batch io;
+    return io.uses_uring() ? "io_uring" : "pread";
+#endif
+}
+
+// runs op for about a fifth of a second and reports the average
+template< typename Op >
+void bench( const char *name, Op op ) {
+    using namespace std::chrono;
+
+    for ( int i = 0; i < 100; ++i ) // warm up caches and descriptors
+        op( i );
+
+    long ops = 0;
+    const auto start = steady_clock::now();
+    auto elapsed = nanoseconds( 0 );
+    while ( elapsed < milliseconds( 200 ) ) {
+        for ( int i = 0; i < 1000; ++i )
+            op( i );
+        ops += 1000;
+        elapsed = steady_clock::now() - start;
+    }
+
+    std::cout << name << "," << backend() << ","
+              << double( elapsed.count() ) / ops << "," << ops << std::endl;
+}
+
+int main() {
+    FakeSysfs sys( SYS_ROOT );
+    sys.brick();
+
+    Probe probe;
+    color_sensor eye( INPUT_1 );
+    medium_motor arm( OUTPUT_B );
+    assert( probe.connected() && eye.connected() && arm.connected() );
+
+    volatile int sink = 0;
+
+    std::cout << "benchmark,backend,ns_per_op,ops" << std::endl;
+
+    bench( "get_attr_int", [&]( int ) { sink = probe.get_attr_int( "duty_cycle" ); } );
+    bench( "set_attr_int", [&]( int i ) { probe.set_attr_int( "duty_cycle_sp", i & 63 ); } );
+    bench( "sensor_value", [&]( int ) { sink = eye.value( 0 ); } );
+    bench( "motor_position", [&]( int ) { sink = arm.position(); } );
+    bench( "device_connect", [&]( int ) {
+            motor m( OUTPUT_D );
+            sink = m.connected();
+        } );
+
+    // one sample of the sensor sweep as taken by SensorControl's sampler
+    io_batch io;
+    sensor::sample raw;
+    int pos = 0, running = 0, rgb[ 3 ];
+    bench( "sensor_tick", [&]( int ) {
+            eye.queue_sample( io, raw );
+            arm.queue_position( io, pos );
+            arm.queue_run( io, running );
+            io.submit();
+            sink = eye.decode( raw, rgb, 3 );
+        } );
+
+    return 0;
+}
@@ -2,9 +2,10 @@
 
 #include "job.h"
 #include <vector>
-#include <cassert>
 #include <thread>
 #include <numeric>
+#undef NDEBUG // the checks run in release builds (MODE=Release) too
+#include <cassert>
 
 #ifdef __divine__
 constexpr int lim = 3;
@@ -37,17 +38,31 @@ int main() {
                 int j = 0;
                 for ( auto &x : vec )
                     x = j++;
+                const int expected = std::accumulate( vec.begin(), vec.end(), 0 );
                 AP( pre_assign_in );
-                auto r = in.tryAssign( vec );
-                if ( !r )
-                    in.assign( vec );
+                if ( i % 2 ) { // copy in, or swap when busy
+                    auto r = in.tryAssign( vec );
+                    if ( !r )
+                        in.assign( vec );
+                } else { // swap in, vec gets the storage back
+                    while ( !in.tryExchange( vec ) )
+                        ;
+                }
 
-                std::pair< bool, int > val{ false, 0 };
-                while ( !val.first )
-                    val = out.tryCopyOut();
-                AP( post_get_out );
-                assert( val.first );
-                assert( std::accumulate( vec.begin(), vec.end(), 0 ) == val.second );
+                if ( i % 3 ) {
+                    std::pair< bool, int > val{ false, 0 };
+                    while ( !val.first )
+                        val = out.tryCopyOut();
+                    AP( post_get_out );
+                    assert( val.first );
+                    assert( expected == val.second );
+                } else {
+                    int val = -1;
+                    while ( !out.tryTakeOut( val ) )
+                        ;
+                    AP( post_get_out );
+                    assert( expected == val );
+                }
             }
             done = true;
             in.cancelWaits();
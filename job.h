@@ -1,6 +1,13 @@
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
+#include <thread>
+#include <utility>
+#ifndef __divine__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #ifndef _JOB_H
 #define _JOB_H
@@ -18,12 +25,27 @@ struct GuardedVar {
         canceled = false;
     }
 
-    // try to assign value, if it is curretly being processed, no assignment
-    // is done and false is returned
-    bool tryAssign( T &val ) {
+    // try to assign a copy of val, if value is curretly being processed, no
+    // assignment is done and false is returned
+    bool tryAssign( const T &val ) {
         auto g = protect( std::try_to_lock );
         if ( g.owns_lock() ) {
-            _assign( val );
+            this->value = val;
+            ready = true;
+            cond.notify_one();
+            return true;
+        }
+        return false;
+    }
+
+    // as tryAssign, but swaps val in as assign( T & ) does, val gets the
+    // storage of the previous value (processed or not) to be reused
+    bool tryExchange( T &val ) {
+        auto g = protect( std::try_to_lock );
+        if ( g.owns_lock() ) {
+            std::swap( this->value, val );
+            ready = true;
+            cond.notify_one();
             return true;
         }
         return false;
@@ -74,6 +96,21 @@ struct GuardedVar {
         return { false, T() };
     }
 
+    // try to take value out without copying it - if it is ready swap it with
+    // out and invalidate it, the previous content of out is left in its place
+    // to be reused by the next assign( T & ) or tryExchange
+    bool tryTakeOut( T &out ) {
+        if ( ready ) {
+            auto g = protect();
+            if ( ready ) {
+                ready = false;
+                std::swap( this->value, out );
+                return true;
+            }
+        }
+        return false;
+    }
+
     void cancelWaits() { canceled = true; cond.notify_all(); }
 
   private:
@@ -87,6 +124,111 @@ struct GuardedVar {
     Guard protect( Args... args ) { return Guard( mutex, args... ); }
 };
 
+// Triple buffer passing the latest value from one producer to one consumer
+// thread without locks. Each side owns one of the three slots and the third
+// one, in the middle, is exchanged atomically: publishing swaps the producer's
+// slot into the middle and taking a fresh value swaps it out to the consumer,
+// so values are handed over rather than copied and neither side blocks the
+// other. A value which is not taken before the next one is published is
+// skipped.
+template< typename T >
+struct Mailbox {
+
+    Mailbox() = default;
+
+    // producer only, the slot to fill before publish(), it holds a value
+    // handed back by the consumer (or skipped)
+    T &back() { return _slots[ _back ]; }
+
+    // producer only, makes back() the latest value
+    void publish() {
+        auto old = _middle.exchange( _back | fresh, std::memory_order_seq_cst );
+        _back = old & index;
+        if ( old & waiting )
+            _wake();
+    }
+
+    // producer only, swaps val into the mailbox and publishes it, val gets
+    // the previous content of back()
+    void publish( T &val ) {
+        std::swap( back(), val );
+        publish();
+    }
+
+    void publish( T &&val ) {
+        back() = std::move( val );
+        publish();
+    }
+
+    // consumer only, if a value was published since the last one was taken,
+    // runs callback with it (as T &) and returns true
+    template< typename Callback >
+    bool tryRead( Callback callback ) {
+        if ( !( _middle.load( std::memory_order_relaxed ) & fresh ) )
+            return false;
+        _front = _middle.exchange( _front, std::memory_order_acq_rel ) & index;
+        callback( _slots[ _front ] );
+        return true;
+    }
+
+    // consumer only, waits for a value as tryRead, returns false if the wait
+    // was canceled
+    template< typename Callback >
+    bool waitAndRead( Callback callback ) {
+        while ( !tryRead( callback ) ) {
+            auto cur = _middle.load( std::memory_order_relaxed );
+            if ( cur & fresh )
+                continue;
+            if ( !_middle.compare_exchange_strong( cur, cur | waiting, std::memory_order_seq_cst ) )
+                continue;
+            if ( _canceled.load( std::memory_order_seq_cst ) )
+                return false;
+            _sleep( cur | waiting );
+        }
+        return true;
+    }
+
+    void cancelWaits() {
+        _canceled.store( true, std::memory_order_seq_cst );
+        if ( _middle.fetch_and( ~waiting, std::memory_order_seq_cst ) & waiting )
+            _wake();
+    }
+
+  private:
+    static constexpr unsigned index = 3, fresh = 4, waiting = 8;
+
+    T _slots[ 3 ];
+    unsigned _back = 0;                      // producer only
+    unsigned _front = 1;                     // consumer only
+    std::atomic< unsigned > _middle{ 2 };    // index | fresh | waiting
+    std::atomic< bool > _canceled{ false };
+
+#ifndef __divine__
+    // the futex calls below treat _middle as the plain 32-bit word inside
+    static_assert( sizeof( std::atomic< unsigned > ) == sizeof( unsigned ) && sizeof( unsigned ) == 4,
+                   "futex needs std::atomic< unsigned > to be a bare 32-bit word" );
+    static_assert( ATOMIC_INT_LOCK_FREE == 2, "futex needs a lock-free std::atomic< unsigned >" );
+#endif
+
+    // blocks while _middle is cur, spuriously too
+    void _sleep( unsigned cur ) {
+#ifdef __divine__
+        (void)cur;
+        std::this_thread::yield();
+#else
+        syscall( SYS_futex, reinterpret_cast< unsigned * >( &_middle ),
+                 FUTEX_WAIT_PRIVATE, cur, nullptr, nullptr, 0 );
+#endif
+    }
+
+    void _wake() {
+#ifndef __divine__
+        syscall( SYS_futex, reinterpret_cast< unsigned * >( &_middle ),
+                 FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0 );
+#endif
+    }
+};
+
 } // namespace job
 
 #endif // _JOB_H
@@ -0,0 +1,70 @@
+// divine-cflags: -std=c++14
+
+#include "job.h"
+#include <vector>
+#include <thread>
+#include <numeric>
+#undef NDEBUG // the checks run in release builds (MODE=Release) too
+#include <cassert>
+
+#ifdef __divine__
+constexpr int lim = 3;
+
+// override new to non-failing version
+#include <new>
+
+void* operator new  ( std::size_t count ) { return __divine_malloc( count ); }
+
+enum APs { halt };
+LTL( halt, F( halt ) );
+#else
+constexpr int lim = 100000;
+#define AP( x ) ((void)(0))
+#endif
+
+// vector which counts its copies, values are handed over without them
+struct Payload {
+    static std::atomic< int > copies;
+    Payload() = default;
+    Payload( const Payload &o ) : vec( o.vec ) { ++copies; }
+    Payload( Payload && ) = default;
+    Payload &operator=( const Payload &o ) { vec = o.vec; ++copies; return *this; }
+    Payload &operator=( Payload && ) = default;
+    std::vector< int > vec;
+};
+std::atomic< int > Payload::copies{ 0 };
+
+// value i is a vector of i % 4 + 1 copies of i, so that a value read while it
+// is being written would not be consistent
+int main() {
+    job::Mailbox< Payload > box;
+    std::atomic< int > last{ -1 };
+
+    std::thread producer( [&] {
+            for ( int i = 0; i < lim; ++i ) {
+                box.back().vec.assign( i % 4 + 1, i );
+                box.publish();
+            }
+            while ( last != lim - 1 ) // the latest value is never lost
+                std::this_thread::yield();
+            box.cancelWaits();
+        } );
+
+    int read = 0;
+    while ( box.waitAndRead( [&]( Payload &p ) {
+                auto &vec = p.vec;
+                assert( !vec.empty() && int( vec.size() ) == vec.front() % 4 + 1 );
+                assert( std::accumulate( vec.begin(), vec.end(), 0L ) == long( vec.size() ) * vec.front() );
+                assert( vec.front() > last ); // in order, possibly skipping some
+                last = vec.front();
+                ++read;
+            } ) )
+        ;
+    producer.join();
+
+    assert( last == lim - 1 && read <= lim );
+    const bool stale = box.tryRead( []( Payload & ) { } );
+    assert( !stale );
+    assert( Payload::copies == 0 );
+    AP( halt );
+}
@@ -0,0 +1,39 @@
+#include "ev3dev.h"
+#include <string>
+#undef NDEBUG // the checks run in release builds (MODE=Release) too
+#include <cassert>
+
+// interning of mode names and sets of them beyond the bitmask of mode_set,
+// which words from long attribute lists (e.g. LED triggers) get into
+
+using namespace ev3dev;
+
+int main() {
+    const mode_type hold( "hold" );
+    assert( hold == mode_type( std::string( "hold" ) ) && hold.str() == "hold" );
+    assert( mode_type().empty() && !hold.empty() && hold != mode_type( "coast" ) );
+
+    mode_set words;
+    for ( int i = 0; i < 600; ++i )
+        words.insert( mode_type( "word" + std::to_string( i ) ) );
+    assert( words.size() == 600 && words.count( mode_type( "word599" ) ) );
+    assert( !words.count( hold ) );
+
+    const bool fresh = words.insert( mode_type( "word300" ) );
+    assert( !fresh );
+
+    // in the order the names were interned, across the bitmask and beyond
+    int n = 0;
+    for ( mode_type m : words ) {
+        assert( m.str() == "word" + std::to_string( n ) );
+        ++n;
+    }
+    assert( n == 600 );
+
+    mode_set copy = words;
+    assert( copy == words );
+    copy.insert( hold );
+    assert( copy != words && copy.size() == 601 );
+
+    return 0;
+}
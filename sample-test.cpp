@@ -0,0 +1,48 @@
+#include "ev3dev.h"
+#include "fakesysfs.h"
+#undef NDEBUG // the checks run in release builds (MODE=Release) too
+#include <cassert>
+
+// built with SYS_ROOT pointing to a fake sysfs tree which is created here;
+// sensor samples and motor setpoints going through an io_batch
+
+using namespace ev3dev;
+
+int main() {
+    FakeSysfs::remove( SYS_ROOT ); // left by an earlier run that crashed
+    FakeSysfs sys( SYS_ROOT );
+    sys.brick();
+
+    io_batch io;
+    sensor::sample raw;
+    int v[ 3 ] = { -1, -1, -1 };
+
+    // from bin_data
+    color_sensor eye( INPUT_1 );
+    eye.queue_sample( io, raw );
+    bool submitted = io.submit();
+    assert( submitted );
+    unsigned n = eye.decode( raw, v, 3 );
+    assert( n == 3 && v[ 0 ] == 100 && v[ 1 ] == 101 && v[ 2 ] == 102 );
+
+    // a driver without bin_data, batched samples read value<N> instead
+    FakeSysfs::remove( sys.sensorDir( 1 ) + "bin_data" );
+    sensor touch( INPUT_4 );
+    touch.queue_sample( io, raw );
+    submitted = io.submit();
+    assert( submitted );
+    n = touch.decode( raw, v, 1 );
+    assert( n == 1 && v[ 0 ] == 100 );
+
+    // setpoints are shadowed once written, unchanged ones are skipped
+    large_motor drive( OUTPUT_A );
+    drive.queue_pulses_per_second_sp( io, 300 );
+    submitted = io.submit();
+    assert( submitted && FakeSysfs::get( sys.motorDir( 0 ) + "pulses_per_second_sp" ) == "300" );
+    drive.queue_pulses_per_second_sp( io, 300 );
+    submitted = io.submit();
+    assert( submitted );
+    assert( drive.setpoint_writes().issued == 1 && drive.setpoint_writes().skipped == 1 );
+
+    return 0;
+}
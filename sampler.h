@@ -0,0 +1,141 @@
+#include "ev3dev.h"
+#include "buffer.h"
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cassert>
+
+#ifndef _SAMPLER_H
+#define _SAMPLER_H
+
+struct Sample {
+    long time; // ns of steady clock
+    int pos;
+    int rgb[ 3 ];
+    bool sweepEnd; // last sample before the arm reversed
+};
+
+// Samples the color sensor and arm encoder in a dedicated thread as fast as
+// the drivers allow, reversing the arm at the end of each sweep. The control
+// loop takes the samples out one whole sweep at a time.
+struct Sampler {
+    static constexpr int capacity = 1023; // 1024 slots with the spare one
+
+    Sampler( ev3dev::sensor &eye, ev3dev::motor &arm, int limit_ccw, int limit_cw ) :
+        _eye( &eye ), _arm( &arm ), _limit_ccw( limit_ccw ), _limit_cw( limit_cw )
+    { }
+
+    ~Sampler() { stop(); }
+
+    void spawn() {
+        assert( !_thr.joinable() );
+        _stop = false;
+        _thr = std::thread( [&] { this->run(); } );
+    }
+
+    void stop() {
+        if ( _thr.joinable() ) {
+            _stop = true;
+            _thr.join();
+            _cond.notify_all();
+        }
+    }
+
+    // waits at most timeout for a finished sweep and calls callback with each
+    // of its samples (of type const Sample &), returns false on timeout
+    template< typename Callback >
+    bool takeSweep( Callback callback, std::chrono::milliseconds timeout ) {
+        if ( _taken == _sweeps.load( std::memory_order_acquire ) ) {
+            std::unique_lock< std::mutex > g( _mutex );
+            _cond.wait_for( g, timeout, [&] { return _taken != _sweeps || _stop; } );
+            if ( _taken == _sweeps )
+                return false;
+        }
+
+        bool end = false;
+        while ( !end && _ring.consume( [&]( const Sample &s ) {
+                    callback( s );
+                    end = s.sweepEnd;
+                } ) )
+            ;
+        ++_taken;
+        return true;
+    }
+
+    // samples which did not fit into the ring or could not be read
+    long dropped() const { return _dropped; }
+
+    // batches of the sampler thread, to be read once it is stopped
+    const ev3dev::io_batch &io() const { return _io; }
+
+  private:
+    void run() {
+        auto &io = _io;
+        ev3dev::sensor::sample raw;
+        int pos = 0, running = 0;
+        int target = _limit_ccw;
+        int last[ 3 ] = {};
+
+        // nothing here throws, a sample which can't be read is dropped
+        while ( !_stop ) {
+            _eye->queue_sample( io, raw );
+            _arm->queue_position( io, pos );
+            _arm->queue_run( io, running );
+            if ( !io.submit() ) {
+                ++_dropped;
+                continue;
+            }
+
+            Sample s = {};
+            s.time = std::chrono::duration_cast< std::chrono::nanoseconds >(
+                        std::chrono::steady_clock::now().time_since_epoch() ).count();
+            s.pos = pos;
+            s.sweepEnd = !running;
+            if ( _eye->decode( raw, s.rgb, 3 ) == 3 )
+                std::copy( s.rgb, s.rgb + 3, last );
+            else if ( !s.sweepEnd ) {
+                ++_dropped;
+                continue;
+            } else // the sweep still has to end
+                std::copy( last, last + 3, s.rgb );
+
+            if ( s.sweepEnd ) {
+                // on failure the arm stays put and the next sample retries
+                const int next = target == _limit_cw ? _limit_ccw : _limit_cw;
+                if ( !_arm->try_set_position_sp( next ) && !_arm->try_start() )
+                    target = next;
+
+                // sweep ends always get a slot (one is kept free for them),
+                // otherwise sweeps would merge
+                while ( !_ring.push_back( s ) && !_stop )
+                    std::this_thread::yield();
+
+                _sweeps.fetch_add( 1, std::memory_order_release );
+                { std::lock_guard< std::mutex > g( _mutex ); }
+                _cond.notify_one();
+            } else if ( _ring.size() >= capacity - 1 || !_ring.push_back( s ) )
+                ++_dropped;
+        }
+    }
+
+    ev3dev::sensor *_eye;
+    ev3dev::motor *_arm;
+    const int _limit_ccw;
+    const int _limit_cw;
+
+    SpscBuffer< Sample, BufferOverflow::Reject > _ring{ capacity };
+    ev3dev::io_batch _io; // sampler thread only
+    std::atomic< long > _sweeps{ 0 };
+    long _taken = 0; // consumer only
+    std::atomic< long > _dropped{ 0 };
+
+    std::atomic< bool > _stop{ false };
+    std::thread _thr;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+};
+
+#endif // _SAMPLER_H
@@ -0,0 +1,75 @@
+// divine-cflags: -std=c++14
+
+#include "buffer.h"
+#include <vector>
+#include <thread>
+#include <numeric>
+#undef NDEBUG // the checks run in release builds (MODE=Release) too
+#include <cassert>
+
+#ifdef __divine__
+constexpr int lim = 4;
+constexpr int size = 2;
+
+// override new to non-failing version
+#include <new>
+
+void* operator new  ( std::size_t count ) { return __divine_malloc( count ); }
+
+enum APs { halt };
+LTL( halt, F( halt ) );
+#else
+constexpr int lim = 100000;
+constexpr int size = 3;
+#define AP( x ) ((void)(0))
+#endif
+
+// element i is a vector of i % 4 + 1 copies of i, so that an element read
+// while it is being written would not be consistent
+int main() {
+    {
+        // a full buffer keeps its elements with the Reject policy
+        SpscBuffer< int, BufferOverflow::Reject > reject( 2 );
+        bool pushed[ 3 ];
+        for ( int i = 0; i < 3; ++i )
+            pushed[ i ] = reject.push_back( i );
+        assert( pushed[ 0 ] && pushed[ 1 ] && !pushed[ 2 ] );
+        int x = -1;
+        bool popped = reject.pop_front( x );
+        assert( popped && x == 0 && reject.size() == 1 );
+    }
+
+    SpscBuffer< std::vector< int > > buf( size );
+    assert( buf.capacity() == size && buf.empty() );
+    std::atomic< bool > done;
+    done = false;
+    int pushed = 0;
+
+    std::thread producer( [&] {
+            std::vector< int > vec;
+            for ( int i = 0; i < lim; ++i ) {
+                vec.assign( i % 4 + 1, i );
+                pushed += buf.push_back( vec );
+            }
+            done = true;
+        } );
+
+    int last = -1, read = 0;
+    auto check = [&]( std::vector< int > &vec ) {
+        assert( !vec.empty() && int( vec.size() ) == vec.front() % 4 + 1 );
+        assert( std::accumulate( vec.begin(), vec.end(), 0L ) == long( vec.size() ) * vec.front() );
+        assert( vec.front() > last ); // in order, possibly with gaps
+        last = vec.front();
+        ++read;
+    };
+    while ( !done )
+        buf.consume( check );
+    producer.join();
+    while ( buf.consume( check ) )
+        ;
+
+    assert( read <= pushed && pushed <= lim );
+    assert( last == lim - 1 || pushed < lim ); // the newest one is kept
+    assert( buf.empty() );
+    AP( halt );
+}
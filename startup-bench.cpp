@@ -0,0 +1,52 @@
+#include "ev3dev.h"
+#include "fakesysfs.h"
+#include <cstdlib>
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <cassert>
+
+// Cold-start cost of device discovery. Built with SYS_ROOT pointing to a fake
+// sysfs tree which is created here, run with EV3DEV_NO_INDEX=1 to compare
+// against scanning the class directory on every connect. The first round
+// reads the same attributes either way and costs about the same, the index
+// pays off in the later rounds.
+
+long now_us() {
+    return std::chrono::duration_cast< std::chrono::microseconds >(
+                std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// connects every motor and sensor by port, as a program's constructors would
+void connectAll() {
+    for ( auto &port : { ev3dev::OUTPUT_A, ev3dev::OUTPUT_B, ev3dev::OUTPUT_C, ev3dev::OUTPUT_D } ) {
+        ev3dev::motor m( port );
+        assert( m.connected() );
+    }
+    for ( auto &port : { ev3dev::INPUT_1, ev3dev::INPUT_2, ev3dev::INPUT_3, ev3dev::INPUT_4 } ) {
+        ev3dev::sensor s( port );
+        assert( s.connected() );
+    }
+}
+
+int main() {
+    FakeSysfs sys( SYS_ROOT );
+    for ( int i = 0; i < 4; ++i ) {
+        sys.motor( i, std::string( "out" ) + char( 'A' + i ) );
+        sys.sensor( i, "in" + std::to_string( i + 1 ), "lego-ev3-uart-29",
+                    "COL-REFLECT", "COL-REFLECT COL-AMBIENT", 1 );
+    }
+
+    const int rounds = 20;
+    long start = now_us();
+    connectAll();
+    long cold = now_us() - start;
+    for ( int i = 1; i < rounds; ++i )
+        connectAll();
+    long total = now_us() - start;
+
+    std::cout << "discovery index " << ( std::getenv( "EV3DEV_NO_INDEX" ) ? "off" : "on" )
+              << ": cold start " << cold << " us, "
+              << rounds << " rounds " << total << " us" << std::endl;
+    return 0;
+}